@@ -1,8 +1,53 @@
+#include <stdarg.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
+#include <atomic>
 #include <limits>
-
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// The JIT emits SysV x86-64 code into mmap'd memory
+#if defined( __x86_64__ ) && defined( __linux__ )
+#define SIM_JIT_SUPPORTED 1
+#include <sys/mman.h>
+#else
+#define SIM_JIT_SUPPORTED 0
+#endif
+
+// Programs are mapped rather than read, and sparse dumps leave holes, where POSIX file I/O exists
+#if defined( __unix__ ) || defined( __APPLE__ )
+#define SIM_POSIX_IO 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define SIM_POSIX_IO 0
+#endif
+
+// Vector width of the lockstep kernels: AVX2 when the build targets it, SSE2 otherwise
+#if defined( __AVX2__ )
+#define SIM_LANE_SIMD 2
+#include <immintrin.h>
+#elif defined( __SSE2__ ) || defined( _M_X64 )
+#define SIM_LANE_SIMD 1
+#include <emmintrin.h>
+#else
+#define SIM_LANE_SIMD 0
+#endif
+
+using uint64 = uint64_t;
 using uint32 = uint32_t;
 using uint16 = uint16_t;
 using int32 = int32_t;
@@ -10,6 +55,12 @@ using int16 = int16_t;
 using uint8 = uint8_t;
 using int8 = int8_t;
 
+#if defined( _MSC_VER )
+#define FORCEINLINE __forceinline
+#else
+#define FORCEINLINE inline __attribute__(( always_inline ))
+#endif
+
 const char* GRegTableL[] = {
     "AL",
     "CL",
@@ -21,6 +72,10 @@ const char* GRegTableL[] = {
     "BH"
 };
 
+// Index of each byte register in RegisterFile::Bytes: AL..BL and AH..BH are the low and
+// high halves of AX..BX, which the host stores little-endian like the 8086
+constexpr uint8 GByteRegOffsets[] = { 0, 2, 4, 6, 1, 3, 5, 7 };
+
 const char* GRegTableX[] = {
     "AX",
     "CX",
@@ -32,6 +87,19 @@ const char* GRegTableX[] = {
     "DI"
 };
 
+// Segment registers, in the order of the sreg field of the segment register MOVs
+const char* GSegTable[] = {
+    "ES",
+    "CS",
+    "SS",
+    "DS"
+};
+
+constexpr uint8 SegES = 0;
+constexpr uint8 SegCS = 1;
+constexpr uint8 SegSS = 2;
+constexpr uint8 SegDS = 3;
+
 const char* GRegMemTable[] = {
     "BX + SI", // 3 + 6
     "BX + DI", // 3 + 7
@@ -46,7 +114,7 @@ const char* GRegMemTable[] = {
 uint8 GMemRegTable1[] = { 3, 3, 5, 5, 6, 7, 5, 3 };
 uint8 GMemRegTable2[] = { 6, 7, 6, 7, UINT8_MAX, UINT8_MAX, UINT8_MAX, UINT8_MAX };
 
-enum class IName : uint16
+enum class IName : uint8
 {
     MOV,
     ADD,
@@ -100,799 +168,6931 @@ const char* InstrNames[]
     "LOOP",
     "LOOPZ",
     "LOOPNZ",
-    "JCXZ"
+    "JCXZ",
+    "UNKNOWN"
+};
+
+// Selected at compile time so that the silent build carries no tracing code at all.
+enum class TraceLevel : uint8
+{
+    Off,     // Only the final register dump
+    Summary, // Final register dump plus the executed instruction count
+    Full     // Disassembly, register/memory deltas and flags for every instruction
+};
+
+template <TraceLevel Level, typename... Args>
+inline void Trace( const char* Format, Args... Arguments )
+{
+    if constexpr ( Level == TraceLevel::Full )
+    {
+        printf( Format, Arguments... );
+    }
+}
+
+// Which operands an instruction has, destination first
+enum class OperandForm : uint8
+{
+    None,
+    RegReg,
+    RegImm,
+    MemReg,
+    MemImm,
+    RegMem,
+    Rel8,
+
+    // MOV to and from a segment register, which is always the Reg operand
+    SegReg,
+    SegMem,
+    RegSeg,
+    MemSeg
 };
 
+constexpr bool IsSegmentForm( OperandForm Form )
+{
+    return Form >= OperandForm::SegReg;
+}
+
+// Effective address descriptor kept in Instruction::RegMem by the memory forms: the low three
+// bits index GRegMemTable, EaDisplacement marks an explicit displacement and EaDirect a bare
+// [displacement] address.
+constexpr uint8 EaDisplacement = 0b01000;
+constexpr uint8 EaDirect = 0b10000;
+
 struct Instruction
 {
     IName Name = IName::UNKNOWN;
-    uint8 RegSrc = UINT8_MAX;
-    uint8 MemRegSrc = UINT8_MAX;
-    uint16 DisplSrc = UINT16_MAX;
-    uint8 RegDst = UINT8_MAX;
-    uint8 MemRegDst = UINT8_MAX;
-    uint16 DisplDst = UINT16_MAX;
+    OperandForm Form = OperandForm::None;
+
+    // The register operand: destination for RegReg, RegImm and RegMem, source for MemReg
+    uint8 Reg : 3;
+    uint8 ByteSize : 3;
+    uint8 Wide : 1;
+
+    // Immediate was encoded as a byte and sign-extended to 16 bits (0x83), so it prints signed
+    uint8 SignExtended : 1;
+
+    // The r/m operand: source register for RegReg, effective address descriptor otherwise
+    uint8 RegMem;
+
+    // Address displacement, or the signed 8-bit jump offset for Rel8
+    uint16 Displacement;
+    uint16 Immediate;
+};
+
+static_assert( sizeof( Instruction ) <= 8, "Instruction is expected to fit in 8 bytes" );
+
+bool IsJump( IName Name )
+{
+    return Name >= IName::JE && Name < IName::UNKNOWN;
+}
+
+// Bits of the 8086 FLAGS register that the simulator evaluates
+constexpr uint16 FlagCF = 1 << 0;
+constexpr uint16 FlagPF = 1 << 2;
+constexpr uint16 FlagAF = 1 << 4;
+constexpr uint16 FlagZF = 1 << 6;
+constexpr uint16 FlagSF = 1 << 7;
+constexpr uint16 FlagOF = 1 << 11;
+
+struct FlagInfo
+{
+    const char* Name;
+    uint16 Mask;
+};
+
+constexpr FlagInfo GFlagTable[] = {
+    { "CF", FlagCF },
+    { "PF", FlagPF },
+    { "AF", FlagAF },
+    { "ZF", FlagZF },
+    { "SF", FlagSF },
+    { "OF", FlagOF }
+};
 
+// The operation that last wrote the flags. None means RegisterFile::Flags already holds them.
+enum class FlagOp : uint8
+{
+    None,
+    Add,
+    Sub,
+    Add8,
+    Sub8
+};
+
+struct RegisterFile
+{
+    // Byte registers alias the word registers, so byte ops read and write them in place
     union
     {
-        uint16 Immediate = UINT16_MAX;
-        uint16 Displacement;
+        uint16 GPRs[ sizeof(GRegTableX) / sizeof(GRegTableX[0]) ];
+        uint8 Bytes[ sizeof(GRegTableX) / sizeof(GRegTableX[0]) * 2 ];
     };
 
-    uint8 ByteSize = 0;
+    uint16 IP;
+    uint16 Segs[ sizeof(GSegTable) / sizeof(GSegTable[0]) ];
+
+    // Flags are evaluated lazily: ALU ops only record their operands, and the result and
+    // every flag are recomputed from them when something reads the flags.
+    FlagOp LastFlagOp;
+    uint16 FlagDst;
+    uint16 FlagSrc;
+    uint16 Flags;
+};
+
+// Operand type of a byte or word operation
+template <bool Wide>
+using OperandType = std::conditional_t<Wide, uint16, uint8>;
+
+template <bool Wide>
+FORCEINLINE OperandType<Wide>& GetRegister( RegisterFile& RegFile, uint8 Reg )
+{
+    if constexpr ( Wide )
+    {
+        return RegFile.GPRs[ Reg ];
+    }
+    else
+    {
+        return RegFile.Bytes[ GByteRegOffsets[ Reg ] ];
+    }
+}
 
-    bool Wide = true;
+// Estimated 8086 clocks of a run, in total and per instruction class
+struct ClockStats
+{
+    uint64 Total;
+    uint64 Instructions[ (uint8)IName::UNKNOWN ];
+    uint64 Clocks[ (uint8)IName::UNKNOWN ];
 };
 
-struct RegisterFile
+// Dirty tracking granularity over Storage::Memory
+constexpr uint32 MemoryPageShift = 8;
+constexpr uint32 MemoryPageCount = ( 1 << 16 ) >> MemoryPageShift;
+
+// The 20-bit physical address space. Its first 64KB is Storage::Memory, which holds the
+// program and is all the engines address directly; the rest is paged in on first store.
+constexpr uint32 AddressSpaceSize = 1 << 20;
+constexpr uint32 HighPageShift = 12;
+constexpr uint32 HighPageSize = 1 << HighPageShift;
+constexpr uint32 HighPageCount = ( AddressSpaceSize - ( 1 << 16 ) ) >> HighPageShift;
+
+// A page of physical memory above 64KB, shared copy-on-write by a Storage and every snapshot
+// taken of it or restored from it. Users counts the Storages that hold it; a store to a page
+// with more than one user goes to a private copy of it first.
+struct HighPage
 {
-    uint16 GPRs[ sizeof(GRegTableX) / sizeof(GRegTableX[0]) ];
-    uint16 IP;
-    bool ZF;
-    bool SF;
+    std::atomic<uint32> Users;
+    uint8 Bytes[ HighPageSize ];
 };
 
 struct Storage
 {
     RegisterFile RegFile;
+    ClockStats Clocks;
+
+    // One bit per page written since the last ClearDirtyPages, set by every engine's stores
+    uint64 DirtyPages[ MemoryPageCount / 64 ];
+
+    // Physical memory above 64KB. A null page has never been stored to and reads as zeroes.
+    // Copies go through TakeSnapshot/RestoreSnapshot, which share the pages, and
+    // DeleteStorage drops them.
+    HighPage* HighPages[ HighPageCount ];
+
     uint8 Memory[ 1 << 16 ];
 };
 
-const char* GetRegisterName( uint8 RegID, bool IsWide )
+FORCEINLINE void MarkPageDirty( Storage& Strg, uint16 Address )
 {
-    return IsWide ? GRegTableX[ RegID ] : GRegTableL[ RegID ];
+    uint32 Page = Address >> MemoryPageShift;
+    Strg.DirtyPages[ Page >> 6 ] |= 1ull << ( Page & 63 );
 }
 
-uint16 CalculateMemoryAddress( const Instruction& MovInstr, const RegisterFile& RegFile )
+FORCEINLINE bool IsPageDirty( const Storage& Strg, uint32 Page )
 {
-    uint16 Address = UINT16_MAX;
-    if ( MovInstr.MemRegDst != UINT8_MAX || MovInstr.MemRegSrc != UINT8_MAX )
-    {
-        uint8 MemReg = MovInstr.MemRegDst != UINT8_MAX ? MovInstr.MemRegDst : MovInstr.MemRegSrc;
-        uint8 Reg = GMemRegTable1[ MemReg ];
-        Address = RegFile.GPRs[ Reg ];
+    return ( Strg.DirtyPages[ Page >> 6 ] >> ( Page & 63 ) ) & 1;
+}
+
+// What a null high page reads as
+static const uint8 GZeroPage[ HighPageSize ] = {};
+
+FORCEINLINE const uint8* GetHighPage( const Storage& Strg, uint32 Page )
+{
+    return Strg.HighPages[ Page ] ? Strg.HighPages[ Page ]->Bytes : GZeroPage;
+}
 
-        Reg = GMemRegTable2[ MemReg ];
-        if ( Reg != UINT8_MAX )
+bool HasHighPages( const Storage& Strg )
+{
+    for ( const HighPage* Page : Strg.HighPages )
+    {
+        if ( Page )
         {
-            Address += RegFile.GPRs[ Reg ];
+            return true;
         }
     }
 
-    if ( MovInstr.DisplDst != UINT16_MAX || MovInstr.DisplSrc != UINT16_MAX )
+    return false;
+}
+
+void ReleaseHighPage( HighPage* Page )
+{
+    if ( Page && 1 == Page->Users.fetch_sub( 1, std::memory_order_acq_rel ) )
     {
-        uint16 Displ = MovInstr.DisplDst != UINT16_MAX ? MovInstr.DisplDst : MovInstr.DisplSrc;
-        if ( Address != UINT16_MAX )
-        {
-            Address += Displ;
-        }
-        else
-        {
-            Address = Displ;
-        }
+        delete Page;
     }
+}
 
-    return Address;
+void ReleaseHighPages( Storage& Strg )
+{
+    for ( HighPage*& Page : Strg.HighPages )
+    {
+        ReleaseHighPage( Page );
+        Page = nullptr;
+    }
 }
 
-void DecodeRegToRegMem( const uint8* InstrPtr, Instruction& Instr )
+// A page of its own for a Storage about to store to Shared, which may be null, in place of
+// its reference to Shared
+HighPage* UnshareHighPage( HighPage* Shared )
 {
-    uint8 d = InstrPtr[0] & 0b00000010;
-    uint8 w = InstrPtr[0] & 0b00000001;
-    uint8 mod = ( InstrPtr[1] & 0b11000000 ) >> 6;
-    uint8 reg = ( InstrPtr[1] & 0b00111000 ) >> 3;
-    uint8 r_m = ( InstrPtr[1] & 0b00000111 );
+    HighPage* Page = new HighPage{};
+    Page->Users.store( 1, std::memory_order_relaxed );
+    if ( Shared )
+    {
+        memcpy( Page->Bytes, Shared->Bytes, HighPageSize );
+        ReleaseHighPage( Shared );
+    }
 
-    Instr.Wide = w;
+    return Page;
+}
 
-    switch ( mod )
+void DeleteStorage( Storage* Strg )
+{
+    if ( Strg )
     {
-    case 0b11:
-        {
-            Instr.RegDst = d ? reg : r_m;
-            Instr.RegSrc = d ? r_m : reg;
+        ReleaseHighPages( *Strg );
+        delete Strg;
+    }
+}
 
-            Instr.ByteSize = 2;
-            return;
+// Counts a plain copy, which holds the same page pointers, as one more user of every page
+void ShareHighPages( Storage& Strg )
+{
+    for ( HighPage* Page : Strg.HighPages )
+    {
+        if ( Page )
+        {
+            Page->Users.fetch_add( 1, std::memory_order_relaxed );
         }
+    }
+}
 
-    case 0b00:
-        {
-            if ( r_m == 0b110 )
-            {
-                if ( d )
-                {
-                    Instr.RegDst = reg;
-                    Instr.DisplSrc = *(uint16*)&InstrPtr[2];
-                }
-                else
-                {
-                    Instr.RegSrc = reg;
-                    Instr.DisplDst = *(uint16*)&InstrPtr[2];
-                }
+// The registers and the first 64KB, which every engine addresses directly, are copied; the
+// pages above 64KB are shared until either side stores to them
+Storage* TakeSnapshot( const Storage& Strg )
+{
+    Storage* Snapshot = new Storage( Strg );
+    ShareHighPages( *Snapshot );
 
-                Instr.ByteSize = 4;
+    return Snapshot;
+}
 
-                return;
-            }
+void RestoreSnapshot( Storage& Strg, const Storage& Snapshot )
+{
+    ReleaseHighPages( Strg );
+    memcpy( &Strg, &Snapshot, sizeof( Storage ) );
+    ShareHighPages( Strg );
+}
 
-            if ( d )
-            {
-                Instr.RegDst = reg;
-                Instr.MemRegSrc = r_m;
-            }
-            else
-            {
-                Instr.RegSrc = reg;
-                Instr.MemRegDst = r_m;
-            }
+// FNV-1a over the whole address space
+uint64 HashMemory( const uint8* Memory, size_t Size, uint64 Hash = 14695981039346656037ull )
+{
+    for ( size_t i = 0; i < Size; i++ )
+    {
+        Hash = ( Hash ^ Memory[i] ) * 1099511628211ull;
+    }
 
-            Instr.ByteSize = 2;
-            return;
-        }
+    return Hash;
+}
 
-    case 0b01:
+// HashMemory of the first 64KB, continued over the number and bytes of every high page that
+// is not all zeroes. Programs that stay below 64KB hash as before.
+uint64 HashStorage( const Storage& Strg )
+{
+    uint64 Hash = HashMemory( Strg.Memory, sizeof( Strg.Memory ) );
+    for ( uint32 Page = 0; Page < HighPageCount; Page++ )
+    {
+        const uint8* Bytes = GetHighPage( Strg, Page );
+        if ( Bytes != GZeroPage && 0 != memcmp( Bytes, GZeroPage, HighPageSize ) )
         {
-            if ( d )
-            {
-                Instr.RegDst = reg;
-                Instr.MemRegSrc = r_m;
-                Instr.DisplSrc = InstrPtr[2];
-            }
-            else
-            {
-                Instr.RegSrc = reg;
-                Instr.MemRegDst = r_m;
-                Instr.DisplDst = InstrPtr[2];
-            }
-
-            Instr.ByteSize = 3;
-            return;
+            Hash = HashMemory( (const uint8*)&Page, sizeof( Page ), Hash );
+            Hash = HashMemory( Bytes, HighPageSize, Hash );
         }
+    }
 
-    case 0b10:
-        {
-            if ( d )
-            {
-                Instr.RegDst = reg;
-                Instr.MemRegSrc = r_m;
-                Instr.DisplSrc = *(uint16*)&InstrPtr[2];
-            }
-            else
-            {
-                Instr.RegSrc = reg;
-                Instr.MemRegDst = r_m;
-                Instr.DisplDst = *(uint16*)&InstrPtr[2];
-            }
+    return Hash;
+}
 
-            Instr.ByteSize = 4;
-            return;
-        }
+void ClearDirtyPages( Storage& Strg )
+{
+    memset( Strg.DirtyPages, 0, sizeof( Strg.DirtyPages ) );
+}
 
-    default:
-        {
-            printf( "ERROR: Incorrect instruction!\n" );
-            return;
-        }
-    }
+const char* GetRegisterName( uint8 RegID, bool IsWide )
+{
+    return IsWide ? GRegTableX[ RegID ] : GRegTableL[ RegID ];
 }
 
-void DecodeImmToRegMem( const uint8* InstrPtr, Instruction& Instr, bool IsWide )
+// Segment and offset of a memory operand. Offsets wrap within their segment, so the high byte
+// of a word at offset 0xFFFF is at offset 0 of the same segment.
+struct MemoryAddress
 {
-    uint8 mod = ( InstrPtr[1] & 0b11000000 ) >> 6;
-    uint8 r_m = ( InstrPtr[1] & 0b00000111 );
+    uint32 Base;
+    uint16 Offset;
+};
 
-    switch ( mod )
+FORCEINLINE uint32 GetPhysicalAddress( MemoryAddress Address, uint16 Delta = 0 )
+{
+    return ( Address.Base + (uint16)( Address.Offset + Delta ) ) & ( AddressSpaceSize - 1 );
+}
+
+// Addresses based on BP are in SS, all others in DS
+MemoryAddress CalculateMemoryAddress( const Instruction& Instr, const RegisterFile& RegFile )
+{
+    if ( Instr.RegMem & EaDirect )
     {
-    case 0b11:
-        {
-            Instr.RegDst = r_m;
-            Instr.Immediate = IsWide ? *(uint16*)&InstrPtr[2] : InstrPtr[2];
+        return { (uint32)RegFile.Segs[ SegDS ] << 4, Instr.Displacement };
+    }
 
-            Instr.ByteSize = IsWide ? 4 : 3;
-            return;
-        }
+    uint8 MemReg = Instr.RegMem & 0b111;
+    uint8 Base = GMemRegTable1[ MemReg ];
+    uint16 Offset = RegFile.GPRs[ Base ] + Instr.Displacement;
+
+    uint8 Reg = GMemRegTable2[ MemReg ];
+    if ( Reg != UINT8_MAX )
+    {
+        Offset += RegFile.GPRs[ Reg ];
+    }
+
+    uint8 Segment = Base == 5 ? SegSS : SegDS;
+    return { (uint32)RegFile.Segs[ Segment ] << 4, Offset };
+}
 
+// Fills in the effective address for a memory operand (mod != 0b11) and returns the number
+// of displacement bytes that follow the ModRM byte
+uint8 DecodeEffectiveAddress( const uint8* DisplPtr, uint8 mod, uint8 r_m, Instruction& Instr )
+{
+    switch ( mod )
+    {
     case 0b00:
         {
             if ( r_m == 0b110 )
             {
-                Instr.DisplDst = *(uint16*)&InstrPtr[2];
-                Instr.Immediate = IsWide ? *(uint16*)&InstrPtr[4] : InstrPtr[4];
-
-                Instr.ByteSize = IsWide ? 6 : 5;
-                return;
+                Instr.RegMem = EaDirect;
+                Instr.Displacement = *(uint16*)DisplPtr;
+                return 2;
             }
 
-            Instr.MemRegDst = r_m;
-            Instr.Immediate = IsWide ? *(uint16*)&InstrPtr[2] : InstrPtr[2];
-
-            Instr.ByteSize = IsWide ? 4 : 3;
-            return;
+            Instr.RegMem = r_m;
+            return 0;
         }
 
     case 0b01:
         {
-            Instr.MemRegDst = r_m;
-            Instr.DisplDst = InstrPtr[2];
-            Instr.Immediate = IsWide ? *(uint16*)&InstrPtr[3] : InstrPtr[3];
-
-            Instr.ByteSize = IsWide ? 5 : 4;
-            return;
-        }
-
-    case 0b10:
-        {
-            Instr.MemRegDst = r_m;
-            Instr.DisplDst = *(uint16*)&InstrPtr[2];
-            Instr.Immediate = IsWide ? *(uint16*)&InstrPtr[4] : InstrPtr[4];
-
-            Instr.ByteSize = IsWide ? 6 : 5;
-            return;
+            Instr.RegMem = r_m | EaDisplacement;
+            Instr.Displacement = DisplPtr[0];
+            return 1;
         }
 
     default:
         {
-            printf( "ERROR: Incorrect instruction!\n" );
-            return;
+            Instr.RegMem = r_m | EaDisplacement;
+            Instr.Displacement = *(uint16*)DisplPtr;
+            return 2;
         }
     }
 }
 
-void DecodeJump( const uint8* InstrPtr, Instruction& Instr )
+void DecodeRegToRegMem( const uint8* InstrPtr, Instruction& Instr )
 {
-    switch ( InstrPtr[0] )
-    {
-    case 0b01110100:
-        Instr.Name = IName::JE;
-        Instr.Displacement = InstrPtr[1];
-        break;
+    uint8 d = InstrPtr[0] & 0b00000010;
+    uint8 w = InstrPtr[0] & 0b00000001;
+    uint8 mod = ( InstrPtr[1] & 0b11000000 ) >> 6;
+    uint8 reg = ( InstrPtr[1] & 0b00111000 ) >> 3;
+    uint8 r_m = ( InstrPtr[1] & 0b00000111 );
 
-    case 0b01111100:
-        Instr.Name = IName::JL;
-        Instr.Displacement = InstrPtr[1];
-        break;
+    Instr.Wide = w;
 
-    case 0b01111110:
-        Instr.Name = IName::JLE;
-        Instr.Displacement = InstrPtr[1];
-        break;
+    if ( mod == 0b11 )
+    {
+        Instr.Form = OperandForm::RegReg;
+        Instr.Reg = d ? reg : r_m;
+        Instr.RegMem = d ? r_m : reg;
 
-    case 0b01110010:
-        Instr.Name = IName::JB;
-        Instr.Displacement = InstrPtr[1];
-        break;
+        Instr.ByteSize = 2;
+        return;
+    }
 
-    case 0b01110110:
-        Instr.Name = IName::JBE;
-        Instr.Displacement = InstrPtr[1];
-        break;
+    uint8 DisplSize = DecodeEffectiveAddress( &InstrPtr[2], mod, r_m, Instr );
 
-    case 0b01111010:
-        Instr.Name = IName::JP;
-        Instr.Displacement = InstrPtr[1];
-        break;
+    Instr.Form = d ? OperandForm::RegMem : OperandForm::MemReg;
+    Instr.Reg = reg;
 
-    case 0b01110000:
-        Instr.Name = IName::JO;
-        Instr.Displacement = InstrPtr[1];
-        break;
+    Instr.ByteSize = 2 + DisplSize;
+}
 
-    case 0b01111000:
-        Instr.Name = IName::JS;
-        Instr.Displacement = InstrPtr[1];
-        break;
+void DecodeImmToRegMem( const uint8* InstrPtr, Instruction& Instr, bool IsWide )
+{
+    uint8 mod = ( InstrPtr[1] & 0b11000000 ) >> 6;
+    uint8 r_m = ( InstrPtr[1] & 0b00000111 );
 
-    case 0b01110101:
-        Instr.Name = IName::JNE;
-        Instr.Displacement = InstrPtr[1];
-        break;
+    uint8 DisplSize = 0;
+    if ( mod == 0b11 )
+    {
+        Instr.Form = OperandForm::RegImm;
+        Instr.Reg = r_m;
+    }
+    else
+    {
+        Instr.Form = OperandForm::MemImm;
+        DisplSize = DecodeEffectiveAddress( &InstrPtr[2], mod, r_m, Instr );
+    }
 
-    case 0b01111101:
-        Instr.Name = IName::JNL;
-        Instr.Displacement = InstrPtr[1];
-        break;
+    const uint8* ImmPtr = &InstrPtr[ 2 + DisplSize ];
+    Instr.Immediate = IsWide ? *(uint16*)ImmPtr : ImmPtr[0];
 
-    case 0b01111111:
-        Instr.Name = IName::JNLE;
-        Instr.Displacement = InstrPtr[1];
-        break;
+    Instr.ByteSize = 2 + DisplSize + ( IsWide ? 2 : 1 );
+}
 
-    case 0b01110011:
-        Instr.Name = IName::JNB;
-        Instr.Displacement = InstrPtr[1];
-        break;
+// Clock counts from the 8086 timing tables. Memory operands add the effective address
+// clocks, plus 4 for every word transferred to or from an odd address.
+constexpr uint32 GetBaseClocks( IName Name, OperandForm Form )
+{
+    //                              RegReg  RegImm  MemReg  MemImm  RegMem
+    constexpr uint8 MovClocks[] = { 2,      4,      9,      10,     8 };
+    constexpr uint8 AluClocks[] = { 3,      4,      16,     17,     9 };
+    constexpr uint8 CmpClocks[] = { 3,      4,      9,      10,     9 };
+
+    //                                     SegReg  SegMem  RegSeg  MemSeg
+    constexpr uint8 SegmentMovClocks[] = { 2,      8,      2,      9 };
+    if ( IsSegmentForm( Form ) )
+    {
+        return SegmentMovClocks[ (uint8)Form - (uint8)OperandForm::SegReg ];
+    }
 
-    case 0b01110111:
-        Instr.Name = IName::JNBE;
-        Instr.Displacement = InstrPtr[1];
-        break;
+    uint8 Index = (uint8)Form - (uint8)OperandForm::RegReg;
+    switch ( Name )
+    {
+    case IName::MOV:
+        return MovClocks[ Index ];
 
-    case 0b01111011:
-        Instr.Name = IName::JNP;
-        Instr.Displacement = InstrPtr[1];
-        break;
+    case IName::CMP:
+        return CmpClocks[ Index ];
 
-    case 0b01110001:
-        Instr.Name = IName::JNO;
-        Instr.Displacement = InstrPtr[1];
-        break;
+    default:
+        return AluClocks[ Index ];
+    }
+}
 
-    case 0b01111001:
-        Instr.Name = IName::JNS;
-        Instr.Displacement = InstrPtr[1];
-        break;
+constexpr uint32 GetJumpClocks( IName Name, bool Taken )
+{
+    switch ( Name )
+    {
+    case IName::LOOP:
+        return Taken ? 17 : 5;
 
-    case 0b11100010:
-        Instr.Name = IName::LOOP;
-        Instr.Displacement = InstrPtr[1];
-        break;
+    case IName::LOOPZ:
+    case IName::JCXZ:
+        return Taken ? 18 : 6;
 
-    case 0b11100001:
-        Instr.Name = IName::LOOPZ;
-        Instr.Displacement = InstrPtr[1];
-        break;
+    case IName::LOOPNZ:
+        return Taken ? 19 : 5;
 
-    case 0b11100000:
-        Instr.Name = IName::LOOPNZ;
-        Instr.Displacement = InstrPtr[1];
-        break;
+    default:
+        return Taken ? 16 : 4;
+    }
+}
 
-    case 0b11100011:
-        Instr.Name = IName::JCXZ;
-        Instr.Displacement = InstrPtr[1];
-        break;
+// Indexed by the GRegMemTable entry; an explicit displacement adds 4
+constexpr uint8 GEaClocks[] = { 7, 8, 8, 7, 5, 5, 5, 5 };
+
+uint32 GetEaClocks( uint8 RegMem )
+{
+    if ( RegMem & EaDirect )
+    {
+        return 6;
     }
 
-    Instr.ByteSize = 2;
+    return GEaClocks[ RegMem & 0b111 ] + ( ( RegMem & EaDisplacement ) ? 4 : 0 );
+}
+
+constexpr bool IsMemoryForm( OperandForm Form )
+{
+    return Form == OperandForm::MemReg || Form == OperandForm::MemImm || Form == OperandForm::RegMem
+        || Form == OperandForm::SegMem || Form == OperandForm::MemSeg;
+}
+
+// Memory accesses of a memory form: read-modify-write ops both load and store
+constexpr uint32 GetTransferCount( IName Name, OperandForm Form )
+{
+    bool ReadModifyWrite = ( Name == IName::ADD || Name == IName::SUB ) && ( Form == OperandForm::MemReg || Form == OperandForm::MemImm );
+    return ReadModifyWrite ? 2 : 1;
 }
 
-void ExecuteJump( const Instruction& Instr, RegisterFile& RegFile )
+template <TraceLevel Level>
+FORCEINLINE void CountClocks( ClockStats& Clocks, IName Name, uint32 Base, uint32 Ea, uint32 Penalty )
 {
-    switch ( Instr.Name )
+    if constexpr ( Level != TraceLevel::Off )
     {
-    case IName::JE:
+        uint32 Total = Base + Ea + Penalty;
+        Clocks.Total += Total;
+        Clocks.Instructions[ (uint8)Name ]++;
+        Clocks.Clocks[ (uint8)Name ] += Total;
+
+        if constexpr ( Level == TraceLevel::Full )
         {
-            if ( RegFile.ZF )
+            printf( "Clocks: +%u = %llu", Total, (unsigned long long)Clocks.Total );
+            if ( Ea || Penalty )
             {
-                RegFile.IP += static_cast<int8>( Instr.Displacement );
+                printf( " (%u", Base );
+                if ( Ea )
+                {
+                    printf( " + %uea", Ea );
+                }
+
+                if ( Penalty )
+                {
+                    printf( " + %up", Penalty );
+                }
+
+                printf( ")" );
             }
 
-            return;
+            printf( "\n" );
         }
+    }
+}
+
+struct OperationClocks
+{
+    uint32 Base;
+    uint32 Ea;
+    uint32 Penalty;
+};
+
+// Estimated before the operation runs, as it may change the registers of its own address
+FORCEINLINE OperationClocks EstimateOperationClocks( IName Name, OperandForm Form, const Instruction& Instr, const RegisterFile& RegFile )
+{
+    OperationClocks Clocks{ GetBaseClocks( Name, Form ), 0, 0 };
+    if ( IsMemoryForm( Form ) )
+    {
+        Clocks.Ea = GetEaClocks( Instr.RegMem );
+        if ( Instr.Wide && ( CalculateMemoryAddress( Instr, RegFile ).Offset & 1 ) )
+        {
+            Clocks.Penalty = 4 * GetTransferCount( Name, Form );
+        }
+    }
+
+    return Clocks;
+}
+
+template <TraceLevel Level>
+FORCEINLINE void CountOperationClocks( IName Name, OperandForm Form, const Instruction& Instr, Storage& Strg )
+{
+    if constexpr ( Level != TraceLevel::Off )
+    {
+        OperationClocks Clocks = EstimateOperationClocks( Name, Form, Instr, Strg.RegFile );
+        CountClocks<Level>( Strg.Clocks, Name, Clocks.Base, Clocks.Ea, Clocks.Penalty );
+    }
+}
+
+void PrintClockStats( const ClockStats& Clocks )
+{
+    printf( "Clocks: %llu (%.3f ms at 4.77 MHz)\n", (unsigned long long)Clocks.Total, Clocks.Total / 4770.0 );
+
+    for ( uint8 i = 0; i < (uint8)IName::UNKNOWN; i++ )
+    {
+        if ( Clocks.Instructions[i] )
+        {
+            printf( "  %-6s %10llu instructions %12llu clocks (%.1f avg)\n", InstrNames[i],
+                    (unsigned long long)Clocks.Instructions[i], (unsigned long long)Clocks.Clocks[i],
+                    (double)Clocks.Clocks[i] / Clocks.Instructions[i] );
+        }
+    }
+}
+
+// Conditional jumps the simulator does not evaluate yet
+bool IsJumpImplemented( IName Name )
+{
+    switch ( Name )
+    {
+    case IName::LOOP:
+    case IName::LOOPZ:
+    case IName::LOOPNZ:
+    case IName::JCXZ:
+        return false;
+
+    default:
+        return IsJump( Name );
+    }
+}
+
+// Flags of "Dst + Src" or "Dst - Src" at the width of the operation. Only the flags in Mask
+// are computed.
+template <bool Wide>
+FORCEINLINE uint16 EvaluateAluFlags( bool IsAdd, uint16 Dst, uint16 Src, uint16 Mask )
+{
+    constexpr uint16 SignBit = Wide ? 0x8000 : 0x80;
+
+    OperandType<Wide> Result = IsAdd ? Dst + Src : Dst - Src;
+    uint16 Flags = 0;
+
+    if ( Mask & FlagCF )
+    {
+        Flags |= ( IsAdd ? Result < Dst : Dst < Src ) ? FlagCF : 0;
+    }
+
+    if ( Mask & FlagOF )
+    {
+        uint16 Overflow = IsAdd ? ( Dst ^ Result ) & ( Src ^ Result ) : ( Dst ^ Src ) & ( Dst ^ Result );
+        Flags |= ( Overflow & SignBit ) ? FlagOF : 0;
+    }
+
+    if ( Mask & FlagPF )
+    {
+        uint8 Parity = (uint8)Result;
+        Parity ^= Parity >> 4;
+        Parity ^= Parity >> 2;
+        Parity ^= Parity >> 1;
+        Flags |= ( Parity & 1 ) ? 0 : FlagPF;
+    }
+
+    if ( Mask & FlagAF )
+    {
+        Flags |= ( ( Dst ^ Src ^ Result ) & 0x10 ) ? FlagAF : 0;
+    }
+
+    if ( Mask & FlagZF )
+    {
+        Flags |= Result == 0 ? FlagZF : 0;
+    }
+
+    if ( Mask & FlagSF )
+    {
+        Flags |= ( Result & SignBit ) ? FlagSF : 0;
+    }
+
+    return Flags;
+}
+
+// Recomputes the flags selected by Mask from the last recorded flag-setting operation. Mask
+// is a constant at every call site, so only the flags actually read get computed.
+FORCEINLINE uint16 EvaluateFlags( const RegisterFile& RegFile, uint16 Mask = 0xffff )
+{
+    uint16 Dst = RegFile.FlagDst;
+    uint16 Src = RegFile.FlagSrc;
+
+    switch ( RegFile.LastFlagOp )
+    {
+    case FlagOp::Add:
+        return EvaluateAluFlags<true>( true, Dst, Src, Mask );
+
+    case FlagOp::Sub:
+        return EvaluateAluFlags<true>( false, Dst, Src, Mask );
+
+    case FlagOp::Add8:
+        return EvaluateAluFlags<false>( true, Dst, Src, Mask );
+
+    case FlagOp::Sub8:
+        return EvaluateAluFlags<false>( false, Dst, Src, Mask );
+
+    default:
+        return RegFile.Flags & Mask;
+    }
+}
+
+FORCEINLINE bool IsSignOverflow( const RegisterFile& RegFile )
+{
+    uint16 Flags = EvaluateFlags( RegFile, FlagSF | FlagOF );
+    return Flags == FlagSF || Flags == FlagOF;
+}
+
+FORCEINLINE bool IsJumpTaken( IName Name, const RegisterFile& RegFile )
+{
+    switch ( Name )
+    {
+    case IName::JO:
+        return EvaluateFlags( RegFile, FlagOF );
+
+    case IName::JNO:
+        return !EvaluateFlags( RegFile, FlagOF );
+
+    case IName::JB:
+        return EvaluateFlags( RegFile, FlagCF );
+
+    case IName::JNB:
+        return !EvaluateFlags( RegFile, FlagCF );
+
+    case IName::JE:
+        return EvaluateFlags( RegFile, FlagZF );
+
+    case IName::JNE:
+        return !EvaluateFlags( RegFile, FlagZF );
+
+    case IName::JBE:
+        return EvaluateFlags( RegFile, FlagCF | FlagZF );
+
+    case IName::JNBE:
+        return !EvaluateFlags( RegFile, FlagCF | FlagZF );
 
-    case IName::JNBE:
     case IName::JS:
+        return EvaluateFlags( RegFile, FlagSF );
+
+    case IName::JNS:
+        return !EvaluateFlags( RegFile, FlagSF );
+
+    case IName::JP:
+        return EvaluateFlags( RegFile, FlagPF );
+
+    case IName::JNP:
+        return !EvaluateFlags( RegFile, FlagPF );
+
     case IName::JL:
+        return IsSignOverflow( RegFile );
+
+    case IName::JNL:
+        return !IsSignOverflow( RegFile );
+
+    case IName::JLE:
+        return EvaluateFlags( RegFile, FlagZF ) || IsSignOverflow( RegFile );
+
+    case IName::JNLE:
+        return !EvaluateFlags( RegFile, FlagZF ) && !IsSignOverflow( RegFile );
+
+    default:
+        return false;
+    }
+}
+
+template <TraceLevel Level>
+FORCEINLINE void ExecuteJump( const Instruction& Instr, Storage& Strg )
+{
+    RegisterFile& RegFile = Strg.RegFile;
+
+    if ( !IsJumpImplemented( Instr.Name ) )
+    {
+        printf( "ERROR: JMP instruction not implemented!\n" );
+        CountClocks<Level>( Strg.Clocks, Instr.Name, GetJumpClocks( Instr.Name, false ), 0, 0 );
+        return;
+    }
+
+    bool Taken = IsJumpTaken( Instr.Name, RegFile );
+    if ( Taken )
+    {
+        RegFile.IP += static_cast<int8>( Instr.Displacement );
+    }
+
+    CountClocks<Level>( Strg.Clocks, Instr.Name, GetJumpClocks( Instr.Name, Taken ), 0, 0 );
+}
+
+struct OpcodeInfo;
+
+using DecodeHandler = void (*)( const uint8* InstrPtr, const OpcodeInfo& Info, Instruction& Instr );
+
+// Everything the decoder needs to know about a first byte, so that DecodeInstruction
+// is a single table lookup followed by one indirect call.
+struct OpcodeInfo
+{
+    IName Name = IName::UNKNOWN;
+    bool D = false;
+    bool W = false;
+    bool HasModRM = false;
+    uint8 ImmediateSize = 0;
+    DecodeHandler Handler = nullptr;
+};
+
+// Operations selected by the reg field of the 0x80..0x83 immediate group
+constexpr IName GImmGroupNames[] = {
+    IName::ADD,
+    IName::UNKNOWN, // OR
+    IName::UNKNOWN, // ADC
+    IName::UNKNOWN, // SBB
+    IName::UNKNOWN, // AND
+    IName::SUB,
+    IName::UNKNOWN, // XOR
+    IName::CMP
+};
+
+void DecodeUnknown( const uint8*, const OpcodeInfo&, Instruction& Instr )
+{
+    Instr.ByteSize = 1;
+}
+
+void DecodeRegMemOp( const uint8* InstrPtr, const OpcodeInfo&, Instruction& Instr )
+{
+    DecodeRegToRegMem( InstrPtr, Instr );
+}
+
+void DecodeImmToAcc( const uint8* InstrPtr, const OpcodeInfo& Info, Instruction& Instr )
+{
+    Instr.Form = OperandForm::RegImm;
+    Instr.Reg = 0;
+    Instr.Immediate = Info.ImmediateSize == 2 ? *(uint16*)&InstrPtr[1] : InstrPtr[1];
+
+    Instr.ByteSize = 1 + Info.ImmediateSize;
+}
+
+void DecodeImmToReg( const uint8* InstrPtr, const OpcodeInfo& Info, Instruction& Instr )
+{
+    Instr.Form = OperandForm::RegImm;
+    Instr.Reg = InstrPtr[0] & 0b00000111;
+    Instr.Immediate = Info.ImmediateSize == 2 ? *(uint16*)&InstrPtr[1] : InstrPtr[1];
+
+    Instr.ByteSize = 1 + Info.ImmediateSize;
+}
+
+void DecodeImmToRegMemOp( const uint8* InstrPtr, const OpcodeInfo& Info, Instruction& Instr )
+{
+    DecodeImmToRegMem( InstrPtr, Instr, Info.ImmediateSize == 2 );
+}
+
+void DecodeImmGroup( const uint8* InstrPtr, const OpcodeInfo& Info, Instruction& Instr )
+{
+    Instr.Name = GImmGroupNames[ ( InstrPtr[1] >> 3 ) & 0b00000111 ];
+    DecodeImmToRegMem( InstrPtr, Instr, Info.ImmediateSize == 2 );
+
+    // s = 1 with w = 1 (0x83): the byte immediate is sign-extended to the word operand
+    if ( Info.D && Info.W )
+    {
+        Instr.Immediate = (uint16)(int16)(int8)Instr.Immediate;
+        Instr.SignExtended = true;
+    }
+}
+
+// mov r/m16, sreg (0x8C) and mov sreg, r/m16 (0x8E): bit 1 is d and the reg field holds the
+// segment register, of which the 8086 only looks at the low two bits
+void DecodeSegmentMove( const uint8* InstrPtr, const OpcodeInfo& Info, Instruction& Instr )
+{
+    uint8 mod = ( InstrPtr[1] & 0b11000000 ) >> 6;
+    uint8 r_m = ( InstrPtr[1] & 0b00000111 );
+
+    Instr.Reg = ( InstrPtr[1] >> 3 ) & 0b011;
+
+    if ( mod == 0b11 )
+    {
+        Instr.Form = Info.D ? OperandForm::SegReg : OperandForm::RegSeg;
+        Instr.RegMem = r_m;
+        Instr.ByteSize = 2;
+        return;
+    }
+
+    uint8 DisplSize = DecodeEffectiveAddress( &InstrPtr[2], mod, r_m, Instr );
+
+    Instr.Form = Info.D ? OperandForm::SegMem : OperandForm::MemSeg;
+    Instr.ByteSize = 2 + DisplSize;
+}
+
+void DecodeJump( const uint8* InstrPtr, const OpcodeInfo&, Instruction& Instr )
+{
+    Instr.Form = OperandForm::Rel8;
+    Instr.Displacement = InstrPtr[1];
+    Instr.ByteSize = 2;
+}
+
+struct OpcodeTable
+{
+    OpcodeInfo Entries[ 256 ];
+};
+
+constexpr OpcodeTable BuildOpcodeTable()
+{
+    OpcodeTable Table{};
+
+    for ( int i = 0; i < 256; i++ )
+    {
+        Table.Entries[i].Handler = DecodeUnknown;
+    }
+
+    // op reg/mem, reg/mem: the low two bits are d and w
+    auto AddRegMemOps = [&Table]( uint8 Base, IName Name )
+    {
+        for ( uint8 i = 0; i < 4; i++ )
+        {
+            Table.Entries[ Base + i ] = { Name, bool( i & 0b10 ), bool( i & 0b01 ), true, 0, DecodeRegMemOp };
+        }
+    };
+
+    // op AL/AX, imm: the low bit is w
+    auto AddAccOps = [&Table]( uint8 Base, IName Name )
+    {
+        Table.Entries[ Base + 0 ] = { Name, false, false, false, 1, DecodeImmToAcc };
+        Table.Entries[ Base + 1 ] = { Name, false, true, false, 2, DecodeImmToAcc };
+    };
+
+    AddRegMemOps( 0b10001000, IName::MOV );
+    AddRegMemOps( 0b00000000, IName::ADD );
+    AddRegMemOps( 0b00101000, IName::SUB );
+    AddRegMemOps( 0b00111000, IName::CMP );
+
+    AddAccOps( 0b00000100, IName::ADD );
+    AddAccOps( 0b00101100, IName::SUB );
+    AddAccOps( 0b00111100, IName::CMP );
+
+    // 0x80..0x83: the low bits are s and w. Only s = 0, w = 1 carries a 16-bit immediate;
+    // s = 1, w = 1 carries a byte that DecodeImmGroup sign-extends to 16 bits.
+    for ( uint8 i = 0; i < 4; i++ )
+    {
+        Table.Entries[ 0b10000000 + i ] = { IName::UNKNOWN, bool( i & 0b10 ), bool( i & 0b01 ), true, uint8( i == 1 ? 2 : 1 ), DecodeImmGroup };
+    }
+
+    Table.Entries[ 0b10001100 ] = { IName::MOV, false, true, true, 0, DecodeSegmentMove };
+    Table.Entries[ 0b10001110 ] = { IName::MOV, true, true, true, 0, DecodeSegmentMove };
+
+    Table.Entries[ 0b11000110 ] = { IName::MOV, false, false, true, 1, DecodeImmToRegMemOp };
+    Table.Entries[ 0b11000111 ] = { IName::MOV, false, true, true, 2, DecodeImmToRegMemOp };
+
+    // mov reg, imm: w is bit 3 and the register is encoded in the low three bits
+    for ( uint8 i = 0; i < 16; i++ )
+    {
+        bool w = i & 0b1000;
+        Table.Entries[ 0b10110000 + i ] = { IName::MOV, false, w, false, uint8( w ? 2 : 1 ), DecodeImmToReg };
+    }
+
+    constexpr IName ConditionalJumps[] = {
+        IName::JO, IName::JNO, IName::JB, IName::JNB,
+        IName::JE, IName::JNE, IName::JBE, IName::JNBE,
+        IName::JS, IName::JNS, IName::JP, IName::JNP,
+        IName::JL, IName::JNL, IName::JLE, IName::JNLE
+    };
+
+    for ( uint8 i = 0; i < 16; i++ )
+    {
+        Table.Entries[ 0b01110000 + i ] = { ConditionalJumps[i], false, false, false, 1, DecodeJump };
+    }
+
+    Table.Entries[ 0b11100000 ] = { IName::LOOPNZ, false, false, false, 1, DecodeJump };
+    Table.Entries[ 0b11100001 ] = { IName::LOOPZ, false, false, false, 1, DecodeJump };
+    Table.Entries[ 0b11100010 ] = { IName::LOOP, false, false, false, 1, DecodeJump };
+    Table.Entries[ 0b11100011 ] = { IName::JCXZ, false, false, false, 1, DecodeJump };
+
+    return Table;
+}
+
+constexpr OpcodeTable GOpcodeTable = BuildOpcodeTable();
+
+Instruction DecodeInstruction( const uint8* InstrPtr )
+{
+    const OpcodeInfo& Info = GOpcodeTable.Entries[ InstrPtr[0] ];
+
+    Instruction Instr{};
+    Instr.Name = Info.Name;
+    Instr.Wide = Info.W;
+
+    Info.Handler( InstrPtr, Info, Instr );
+
+    return Instr;
+}
+
+// Decoded instructions keyed by their address in Storage::Memory. Stores into memory
+// invalidate every entry whose encoded bytes they overlap, so self-modifying code
+// is re-decoded on its next execution.
+constexpr uint16 MaxInstructionSize = 6;
+
+struct DecodeCache
+{
+    Instruction Entries[ 1 << 16 ];
+    bool Valid[ 1 << 16 ];
+
+    // ThreadedOp of each entry for SimulateThreaded8086, ThreadedOp::Decode until translated
+    uint8 ThreadedOps[ 1 << 16 ];
+
+    // Non-zero for every byte that has ever been decoded, so a store can cheaply rule out
+    // touching code. Never cleared: a stale mark only costs an InvalidateDecodeCache call.
+    uint8 CodeBytes[ 1 << 16 ];
+
+    // Addresses filled since the last ResetDecodeCache, so that a reset only clears those.
+    // Once more have been filled than fit, the reset clears every entry instead.
+    uint16 Filled[ 1 << 16 ];
+    uint32 FilledCount;
+    bool FilledOverflow;
+
+    // Whoever the entries were decoded for, set by callers that share one cache between guests
+    const void* Owner;
+
+    uint64 Hits;
+    uint64 Misses;
+    uint64 Invalidations;
+};
+
+const Instruction& FetchInstruction( DecodeCache& Cache, const uint8* Memory, uint16 Address )
+{
+    if ( Cache.Valid[ Address ] )
+    {
+        Cache.Hits++;
+        return Cache.Entries[ Address ];
+    }
+
+    Cache.Misses++;
+    Cache.Entries[ Address ] = DecodeInstruction( Memory + Address );
+    Cache.Valid[ Address ] = true;
+
+    if ( Cache.FilledCount < std::size( Cache.Filled ) )
+    {
+        Cache.Filled[ Cache.FilledCount++ ] = Address;
+    }
+    else
+    {
+        Cache.FilledOverflow = true;
+    }
+
+    for ( uint16 i = 0; i < Cache.Entries[ Address ].ByteSize; i++ )
+    {
+        Cache.CodeBytes[ (uint16)( Address + i ) ] = 1;
+    }
+
+    return Cache.Entries[ Address ];
+}
+
+void InvalidateDecodeCache( DecodeCache& Cache, uint16 Address, uint16 Size )
+{
+    uint32 First = Address >= MaxInstructionSize - 1 ? Address - ( MaxInstructionSize - 1 ) : 0;
+    uint32 End = (uint32)Address + Size;
+
+    for ( uint32 i = First; i < End && i < ( 1 << 16 ); i++ )
+    {
+        if ( Cache.Valid[i] && i + Cache.Entries[i].ByteSize > Address )
+        {
+            Cache.Valid[i] = false;
+            Cache.ThreadedOps[i] = 0;
+            Cache.Invalidations++;
+        }
+    }
+}
+
+void PrintEffectiveAddress( const Instruction& Instr )
+{
+    if ( Instr.RegMem & EaDirect )
+    {
+        printf( "[%d]", Instr.Displacement );
+    }
+    else if ( Instr.RegMem & EaDisplacement )
+    {
+        printf( "[%s + %d]", GRegMemTable[ Instr.RegMem & 0b111 ], Instr.Displacement );
+    }
+    else
+    {
+        printf( "[%s]", GRegMemTable[ Instr.RegMem & 0b111 ] );
+    }
+}
+
+int GetPrintedImmediate( const Instruction& Instr )
+{
+    return Instr.SignExtended ? (int16)Instr.Immediate : Instr.Immediate;
+}
+
+void PrintInstruction( const Instruction& Instr )
+{
+    printf( "%s", InstrNames[ (uint8)Instr.Name ] );
+
+    switch ( Instr.Form )
+    {
+    case OperandForm::RegReg:
+        printf( " %s, %s", GetRegisterName( Instr.Reg, Instr.Wide ), GetRegisterName( Instr.RegMem, Instr.Wide ) );
+        break;
+
+    case OperandForm::RegImm:
+        printf( " %s, %d", GetRegisterName( Instr.Reg, Instr.Wide ), GetPrintedImmediate( Instr ) );
+        break;
+
+    case OperandForm::RegMem:
+        printf( " %s, ", GetRegisterName( Instr.Reg, Instr.Wide ) );
+        PrintEffectiveAddress( Instr );
+        break;
+
+    case OperandForm::MemReg:
+        printf( " " );
+        PrintEffectiveAddress( Instr );
+        printf( ", %s", GetRegisterName( Instr.Reg, Instr.Wide ) );
+        break;
+
+    case OperandForm::MemImm:
+        printf( " " );
+        PrintEffectiveAddress( Instr );
+        printf( ", %d", GetPrintedImmediate( Instr ) );
+        break;
+
+    case OperandForm::Rel8:
+        printf( " %d", static_cast<int8>( Instr.Displacement ) );
+        break;
+
+    case OperandForm::SegReg:
+        printf( " %s, %s", GSegTable[ Instr.Reg ], GRegTableX[ Instr.RegMem ] );
+        break;
+
+    case OperandForm::SegMem:
+        printf( " %s, ", GSegTable[ Instr.Reg ] );
+        PrintEffectiveAddress( Instr );
+        break;
+
+    case OperandForm::RegSeg:
+        printf( " %s, %s", GRegTableX[ Instr.RegMem ], GSegTable[ Instr.Reg ] );
+        break;
+
+    case OperandForm::MemSeg:
+        printf( " " );
+        PrintEffectiveAddress( Instr );
+        printf( ", %s", GSegTable[ Instr.Reg ] );
+        break;
+
+    default:
+        break;
+    }
+
+    printf( "\n" );
+}
+
+void PrintFlags( uint16 Flags )
+{
+    for ( const FlagInfo& Flag : GFlagTable )
+    {
+        printf( "%s: %d\n", Flag.Name, ( Flags & Flag.Mask ) ? 1 : 0 );
+    }
+}
+
+// Records an ALU op for EvaluateFlags; nothing is computed unless the flags are read
+template <TraceLevel Level, bool Wide = true>
+FORCEINLINE void SetFlags( IName Name, uint16 Dst, uint16 Src, RegisterFile& RegFile )
+{
+    if constexpr ( Wide )
+    {
+        RegFile.LastFlagOp = Name == IName::ADD ? FlagOp::Add : FlagOp::Sub;
+    }
+    else
+    {
+        RegFile.LastFlagOp = Name == IName::ADD ? FlagOp::Add8 : FlagOp::Sub8;
+    }
+
+    RegFile.FlagDst = Dst;
+    RegFile.FlagSrc = Src;
+
+    if constexpr ( Level == TraceLevel::Full )
+    {
+        PrintFlags( EvaluateFlags( RegFile ) );
+    }
+}
+
+FORCEINLINE uint8 ReadPhysical( const Storage& Strg, uint32 Address )
+{
+    if ( Address < ( 1 << 16 ) )
+    {
+        return Strg.Memory[ Address ];
+    }
+
+    const HighPage* Page = Strg.HighPages[ ( Address >> HighPageShift ) - ( ( 1 << 16 ) >> HighPageShift ) ];
+    return Page ? Page->Bytes[ Address & ( HighPageSize - 1 ) ] : 0;
+}
+
+// Only the first 64KB can hold code or be tracked by DirtyPages
+template <TraceLevel Level>
+FORCEINLINE void WritePhysical( Storage& Strg, DecodeCache& Cache, uint32 Address, uint8 Value )
+{
+    if ( Address < ( 1 << 16 ) )
+    {
+        Strg.Memory[ Address ] = Value;
+        MarkPageDirty( Strg, (uint16)Address );
+        InvalidateDecodeCache( Cache, (uint16)Address, 1 );
+    }
+    else
+    {
+        HighPage*& Page = Strg.HighPages[ ( Address >> HighPageShift ) - ( ( 1 << 16 ) >> HighPageShift ) ];
+        if ( !Page || Page->Users.load( std::memory_order_acquire ) > 1 )
+        {
+            Page = UnshareHighPage( Page );
+        }
+
+        Page->Bytes[ Address & ( HighPageSize - 1 ) ] = Value;
+    }
+
+    Trace<Level>( "Memory[%d] = %d\n", Address, Value );
+}
+
+template <TraceLevel Level>
+void StoreMemory( Storage& Strg, DecodeCache& Cache, MemoryAddress Address, uint16 Value, bool IsWide )
+{
+    WritePhysical<Level>( Strg, Cache, GetPhysicalAddress( Address ), (uint8)( Value & 0x00ff ) );
+
+    if ( IsWide )
+    {
+        WritePhysical<Level>( Strg, Cache, GetPhysicalAddress( Address, 1 ), (uint8)( Value >> 8 ) );
+    }
+}
+
+template <bool Wide = true>
+OperandType<Wide> LoadMemory( const Storage& Strg, MemoryAddress Address )
+{
+    uint8 ValueL = ReadPhysical( Strg, GetPhysicalAddress( Address ) );
+    if constexpr ( Wide )
+    {
+        uint16 ValueH = ReadPhysical( Strg, GetPhysicalAddress( Address, 1 ) );
+        return ( ValueH << 8 ) | ValueL;
+    }
+    else
+    {
+        return ValueL;
+    }
+}
+
+FORCEINLINE uint16 ExecuteAlu( IName Name, uint16 Dst, uint16 Src )
+{
+    switch ( Name )
+    {
+    case IName::MOV:
+        return Src;
+
+    case IName::ADD:
+        return Dst + Src;
+
+    default:
+        return Dst - Src;
+    }
+}
+
+// Shared by both engines: the interpreter passes the decoded name and form, the threaded
+// engine passes constants so that each of its handlers collapses to a single path. Wide is
+// Instr.Wide as a constant, so byte and word operands each get their own path. The block
+// engine clears RecordFlags for ops whose flags are overwritten before anything reads them.
+template <TraceLevel Level, bool Wide, bool RecordFlags = true>
+FORCEINLINE void ExecuteOperation( IName Name, OperandForm Form, const Instruction& Instr, Storage& Strg, DecodeCache& Cache )
+{
+    RegisterFile& RegFile = Strg.RegFile;
+
+    if ( Form != OperandForm::Rel8 )
+    {
+        CountOperationClocks<Level>( Name, Form, Instr, Strg );
+    }
+
+    switch ( Form )
+    {
+    case OperandForm::RegReg:
+    case OperandForm::RegImm:
+    case OperandForm::RegMem:
+        {
+            using Operand = OperandType<Wide>;
+
+            Operand& Dst = GetRegister<Wide>( RegFile, Instr.Reg );
+            Operand Src = 0;
+            if ( Form == OperandForm::RegReg )
+            {
+                Src = GetRegister<Wide>( RegFile, Instr.RegMem );
+            }
+            else if ( Form == OperandForm::RegImm )
+            {
+                Src = (Operand)Instr.Immediate;
+            }
+            else
+            {
+                Src = LoadMemory<Wide>( Strg, CalculateMemoryAddress( Instr, RegFile ) );
+            }
+
+            Operand Result = ExecuteAlu( Name, Dst, Src );
+            if ( Name == IName::CMP )
+            {
+                if constexpr ( RecordFlags )
+                {
+                    SetFlags<Level, Wide>( Name, Dst, Src, RegFile );
+                }
+                break;
+            }
+
+            Operand Prev = Dst;
+            Dst = Result;
+
+            if ( Name == IName::MOV && Form == OperandForm::RegMem )
+            {
+                Trace<Level>( "%s = %d\n", GetRegisterName( Instr.Reg, Wide ), Result );
+            }
+            else
+            {
+                Trace<Level>( Wide ? "%s: 0x%04x => 0x%04x\n" : "%s: 0x%02x => 0x%02x\n", GetRegisterName( Instr.Reg, Wide ), Prev, Result );
+            }
+
+            if ( RecordFlags && Name != IName::MOV )
+            {
+                SetFlags<Level, Wide>( Name, Prev, Src, RegFile );
+            }
+
+            break;
+        }
+
+    case OperandForm::MemReg:
+    case OperandForm::MemImm:
+        {
+            using Operand = OperandType<Wide>;
+
+            MemoryAddress Address = CalculateMemoryAddress( Instr, RegFile );
+            Operand Src = Form == OperandForm::MemReg ? GetRegister<Wide>( RegFile, Instr.Reg ) : (Operand)Instr.Immediate;
+
+            if ( Name == IName::MOV )
+            {
+                StoreMemory<Level>( Strg, Cache, Address, Src, Wide );
+                break;
+            }
+
+            Operand Dst = LoadMemory<Wide>( Strg, Address );
+            Operand Result = ExecuteAlu( Name, Dst, Src );
+            if ( Name != IName::CMP )
+            {
+                StoreMemory<Level>( Strg, Cache, Address, Result, Wide );
+            }
+
+            if constexpr ( RecordFlags )
+            {
+                SetFlags<Level, Wide>( Name, Dst, Src, RegFile );
+            }
+            break;
+        }
+
+    case OperandForm::SegReg:
+    case OperandForm::SegMem:
+        {
+            uint16 Src = Form == OperandForm::SegReg ? RegFile.GPRs[ Instr.RegMem ] : LoadMemory( Strg, CalculateMemoryAddress( Instr, RegFile ) );
+            uint16 Prev = RegFile.Segs[ Instr.Reg ];
+            RegFile.Segs[ Instr.Reg ] = Src;
+
+            Trace<Level>( "%s: 0x%04x => 0x%04x\n", GSegTable[ Instr.Reg ], Prev, Src );
+            break;
+        }
+
+    case OperandForm::RegSeg:
+        {
+            uint16 Prev = RegFile.GPRs[ Instr.RegMem ];
+            RegFile.GPRs[ Instr.RegMem ] = RegFile.Segs[ Instr.Reg ];
+
+            Trace<Level>( "%s: 0x%04x => 0x%04x\n", GRegTableX[ Instr.RegMem ], Prev, RegFile.Segs[ Instr.Reg ] );
+            break;
+        }
+
+    case OperandForm::MemSeg:
+        StoreMemory<Level>( Strg, Cache, CalculateMemoryAddress( Instr, RegFile ), RegFile.Segs[ Instr.Reg ], true );
+        break;
+
+    default:
+        break;
+    }
+}
+
+template <TraceLevel Level>
+void ExecuteInstruction( const Instruction& Instr, Storage& Strg, DecodeCache& Cache )
+{
+    if ( Instr.Wide )
+    {
+        ExecuteOperation<Level, true>( Instr.Name, Instr.Form, Instr, Strg, Cache );
+    }
+    else
+    {
+        ExecuteOperation<Level, false>( Instr.Name, Instr.Form, Instr, Strg, Cache );
+    }
+
+    Strg.RegFile.IP += Instr.ByteSize;
+
+    if ( Instr.Form == OperandForm::Rel8 )
+    {
+        ExecuteJump<Level>( Instr, Strg );
+    }
+}
+
+// Flat per-IP counters filled in by Simulate8086 when profiling
+struct ProfileData
+{
+    uint64 Executions[ 1 << 16 ];
+    uint64 Taken[ 1 << 16 ];
+    uint64 NotTaken[ 1 << 16 ];
+    uint64 Clocks[ 1 << 16 ];
+};
+
+FORCEINLINE void ProfileInstruction( ProfileData& Profile, const Instruction& Instr, const RegisterFile& RegFile )
+{
+    uint16 IP = RegFile.IP;
+    Profile.Executions[ IP ]++;
+
+    if ( Instr.Form == OperandForm::Rel8 )
+    {
+        // Jumps leave the flags alone, so the outcome can be read before they run
+        bool Taken = IsJumpImplemented( Instr.Name ) && IsJumpTaken( Instr.Name, RegFile );
+        ( Taken ? Profile.Taken : Profile.NotTaken )[ IP ]++;
+        Profile.Clocks[ IP ] += GetJumpClocks( Instr.Name, Taken );
+    }
+    else
+    {
+        OperationClocks Clocks = EstimateOperationClocks( Instr.Name, Instr.Form, Instr, RegFile );
+        Profile.Clocks[ IP ] += Clocks.Base + Clocks.Ea + Clocks.Penalty;
+    }
+}
+
+// Executed IPs sorted by clocks spent, disassembled from the final memory contents
+void PrintProfile( const ProfileData& Profile, const uint8* Memory )
+{
+    std::vector<uint16> IPs;
+    uint64 TotalClocks = 0;
+    for ( uint32 IP = 0; IP < ( 1 << 16 ); IP++ )
+    {
+        if ( Profile.Executions[ IP ] )
+        {
+            IPs.push_back( (uint16)IP );
+            TotalClocks += Profile.Clocks[ IP ];
+        }
+    }
+
+    std::sort( IPs.begin(), IPs.end(), [&Profile]( uint16 A, uint16 B )
+    {
+        return Profile.Clocks[A] != Profile.Clocks[B] ? Profile.Clocks[A] > Profile.Clocks[B] : A < B;
+    } );
+
+    printf( "Profile:\n" );
+    printf( "%6s %12s %14s %7s %12s %12s  %s\n", "IP", "Count", "Clocks", "%", "Taken", "Not taken", "Instruction" );
+
+    for ( uint16 IP : IPs )
+    {
+        printf( "%6d %12llu %14llu %6.2f%%", IP, (unsigned long long)Profile.Executions[ IP ], (unsigned long long)Profile.Clocks[ IP ],
+                TotalClocks ? 100.0 * Profile.Clocks[ IP ] / TotalClocks : 0.0 );
+
+        Instruction Instr = DecodeInstruction( Memory + 2 + IP );
+        if ( Instr.Form == OperandForm::Rel8 )
+        {
+            printf( " %12llu %12llu  ", (unsigned long long)Profile.Taken[ IP ], (unsigned long long)Profile.NotTaken[ IP ] );
+        }
+        else
+        {
+            printf( " %12s %12s  ", "", "" );
+        }
+
+        PrintInstruction( Instr );
+    }
+}
+
+struct MemoryDelta
+{
+    uint16 Address;
+    uint8 Old;
+    uint8 New;
+};
+
+// Memory changes of a run, flushed every Interval instructions. Each flush that found a
+// change writes the number of instructions run so far as a uint64, a uint32 record count and
+// then the MemoryDelta records. Only pages marked in Storage::DirtyPages are compared
+// against the shadow copy.
+struct DeltaStream
+{
+    FILE* Output;
+    uint32 Interval;
+    uint32 Pending;
+    uint64 Steps;
+    uint64 Flushes;
+    uint64 Records;
+    bool Failed;
+    uint8 Shadow[ 1 << 16 ];
+    MemoryDelta Changes[ 1 << 16 ];
+};
+
+void BeginDeltas( DeltaStream& Deltas, Storage& Strg )
+{
+    memcpy( Deltas.Shadow, Strg.Memory, sizeof( Deltas.Shadow ) );
+    ClearDirtyPages( Strg );
+}
+
+void FlushDeltas( DeltaStream& Deltas, Storage& Strg )
+{
+    uint32 Count = 0;
+    for ( uint32 Page = 0; Page < MemoryPageCount; Page++ )
+    {
+        if ( !IsPageDirty( Strg, Page ) )
+        {
+            continue;
+        }
+
+        for ( uint32 Address = Page << MemoryPageShift; Address < ( Page + 1 ) << MemoryPageShift; Address++ )
+        {
+            if ( Strg.Memory[ Address ] != Deltas.Shadow[ Address ] )
+            {
+                Deltas.Changes[ Count++ ] = { (uint16)Address, Deltas.Shadow[ Address ], Strg.Memory[ Address ] };
+                Deltas.Shadow[ Address ] = Strg.Memory[ Address ];
+            }
+        }
+    }
+
+    ClearDirtyPages( Strg );
+
+    if ( Count )
+    {
+        Deltas.Failed = Deltas.Failed || 1 != fwrite( &Deltas.Steps, sizeof( Deltas.Steps ), 1, Deltas.Output )
+                        || 1 != fwrite( &Count, sizeof( Count ), 1, Deltas.Output )
+                        || Count != fwrite( Deltas.Changes, sizeof( MemoryDelta ), Count, Deltas.Output );
+
+        Deltas.Flushes++;
+        Deltas.Records += Count;
+    }
+}
+
+enum class PixelFormat : uint8
+{
+    Rgba32,
+    Rgb24,
+    Gray8
+};
+
+constexpr uint8 GPixelSize[] = { 4, 3, 1 };
+
+// Guest framebuffer written out as numbered binary PPM files. Every Interval instructions, or
+// clocks with IntervalInClocks, the pages of the framebuffer marked in Storage::DirtyPages are
+// taken over and a frame is only encoded if one of them has been written since the last one.
+struct FrameExport
+{
+    const char* Prefix;
+    uint16 Base;
+    uint16 Width;
+    uint16 Height;
+    PixelFormat Format;
+    uint64 Interval;
+    bool IntervalInClocks;
+    uint64 NextFrame;
+    uint64 Steps;
+    uint64 Frames;
+    uint64 Skipped;
+    bool Failed;
+    uint64 RegionPages[ MemoryPageCount / 64 ];
+    std::vector<uint8> Encoded;
+};
+
+bool WriteFrame( FrameExport& Export, const uint8* Memory )
+{
+    const uint8 PixelSize = GPixelSize[ (uint8)Export.Format ];
+    const uint8* Pixel = Memory + Export.Base;
+    uint8* Out = Export.Encoded.data() + Export.Encoded.size() - (size_t)Export.Width * Export.Height * 3;
+
+    for ( uint32 i = 0; i < (uint32)Export.Width * Export.Height; i++, Pixel += PixelSize, Out += 3 )
+    {
+        if ( Export.Format == PixelFormat::Gray8 )
+        {
+            Out[0] = Out[1] = Out[2] = Pixel[0];
+        }
+        else
+        {
+            Out[0] = Pixel[0];
+            Out[1] = Pixel[1];
+            Out[2] = Pixel[2];
+        }
+    }
+
+    char Path[ 512 ];
+    snprintf( Path, sizeof( Path ), "%s_%05llu.ppm", Export.Prefix, (unsigned long long)Export.Frames );
+
+    FILE* File = fopen( Path, "wb" );
+    if ( !File )
+    {
+        printf( "ERROR: cannot write %s!\n", Path );
+        return false;
+    }
+
+    bool Written = Export.Encoded.size() == fwrite( Export.Encoded.data(), 1, Export.Encoded.size(), File );
+    Written = 0 == fclose( File ) && Written;
+    if ( !Written )
+    {
+        printf( "ERROR: cannot write %s!\n", Path );
+        return false;
+    }
+
+    Export.Frames++;
+    return true;
+}
+
+bool BeginFrames( FrameExport& Export, Storage& Strg )
+{
+    uint32 Size = (uint32)Export.Width * Export.Height * GPixelSize[ (uint8)Export.Format ];
+    if ( !Size || Export.Base + Size > ( 1 << 16 ) )
+    {
+        printf( "ERROR: framebuffer at %d does not fit in memory!\n", Export.Base );
+        return false;
+    }
+
+    for ( uint32 Page = Export.Base >> MemoryPageShift; Page <= ( Export.Base + Size - 1 ) >> MemoryPageShift; Page++ )
+    {
+        Export.RegionPages[ Page >> 6 ] |= 1ull << ( Page & 63 );
+    }
+
+    char Header[ 32 ];
+    int HeaderSize = snprintf( Header, sizeof( Header ), "P6\n%d %d\n255\n", Export.Width, Export.Height );
+    Export.Encoded.resize( HeaderSize + (size_t)Export.Width * Export.Height * 3 );
+    memcpy( Export.Encoded.data(), Header, HeaderSize );
+
+    // The first frame shows the framebuffer as loaded
+    for ( uint32 i = 0; i < MemoryPageCount / 64; i++ )
+    {
+        Strg.DirtyPages[i] &= ~Export.RegionPages[i];
+    }
+
+    Export.NextFrame = Export.Interval;
+    return WriteFrame( Export, Strg.Memory );
+}
+
+FORCEINLINE uint64 GetFrameTime( const FrameExport& Export, const Storage& Strg )
+{
+    return Export.IntervalInClocks ? Strg.Clocks.Total : Export.Steps;
+}
+
+// Called once the run has reached NextFrame and once more at its end. No frames are written
+// after one has failed.
+void PollFrames( FrameExport& Export, Storage& Strg )
+{
+    Export.NextFrame = GetFrameTime( Export, Strg ) + Export.Interval;
+    if ( Export.Failed )
+    {
+        return;
+    }
+
+    bool Changed = false;
+    for ( uint32 i = 0; i < MemoryPageCount / 64; i++ )
+    {
+        Changed |= ( Strg.DirtyPages[i] & Export.RegionPages[i] ) != 0;
+        Strg.DirtyPages[i] &= ~Export.RegionPages[i];
+    }
+
+    if ( !Changed )
+    {
+        Export.Skipped++;
+        return;
+    }
+
+    Export.Failed = !WriteFrame( Export, Strg.Memory );
+}
+
+// One executed instruction of a binary trace, holding everything the full text trace prints:
+// the encoded bytes, the clocks estimate, the register write, the stored word and the flags
+struct TraceRecord
+{
+    uint16 IP;
+    uint8 Bytes[ MaxInstructionSize ];
+    uint16 RegBefore;
+    uint16 RegAfter;
+    uint16 StoreSegment;
+    uint16 StoreOffset;
+    uint16 StoreValue;
+    uint16 Flags;
+    uint8 BaseClocks;
+    uint8 EaClocks;
+    uint8 PenaltyClocks;
+};
+
+constexpr char TraceFileMagic[ 8 ] = { '8', '0', '8', '6', 'T', 'R', 'C', '2' };
+
+// The register an operation writes: a segment register for the MOVs into one, and a byte
+// register for byte ops
+FORCEINLINE uint16 GetWrittenRegister( const RegisterFile& RegFile, const Instruction& Instr )
+{
+    switch ( Instr.Form )
+    {
+    case OperandForm::SegReg:
+    case OperandForm::SegMem:
+        return RegFile.Segs[ Instr.Reg ];
+
+    case OperandForm::RegSeg:
+        return RegFile.GPRs[ Instr.RegMem ];
+
+    default:
+        return Instr.Wide ? RegFile.GPRs[ Instr.Reg ] : RegFile.Bytes[ GByteRegOffsets[ Instr.Reg ] ];
+    }
+}
+
+FORCEINLINE void BeginTraceRecord( TraceRecord& Record, const Instruction& Instr, const Storage& Strg )
+{
+    const RegisterFile& RegFile = Strg.RegFile;
+
+    Record = {};
+    Record.IP = RegFile.IP;
+    for ( uint16 i = 0; i < Instr.ByteSize; i++ )
+    {
+        Record.Bytes[i] = Strg.Memory[ (uint16)( 2 + RegFile.IP + i ) ];
+    }
+
+    if ( Instr.Form == OperandForm::Rel8 )
+    {
+        bool Taken = IsJumpImplemented( Instr.Name ) && IsJumpTaken( Instr.Name, RegFile );
+        Record.BaseClocks = (uint8)GetJumpClocks( Instr.Name, Taken );
+        return;
+    }
+
+    OperationClocks Clocks = EstimateOperationClocks( Instr.Name, Instr.Form, Instr, RegFile );
+    Record.BaseClocks = (uint8)Clocks.Base;
+    Record.EaClocks = (uint8)Clocks.Ea;
+    Record.PenaltyClocks = (uint8)Clocks.Penalty;
+
+    Record.RegBefore = GetWrittenRegister( RegFile, Instr );
+    if ( IsMemoryForm( Instr.Form ) )
+    {
+        MemoryAddress Address = CalculateMemoryAddress( Instr, RegFile );
+        Record.StoreSegment = (uint16)( Address.Base >> 4 );
+        Record.StoreOffset = Address.Offset;
+    }
+}
+
+FORCEINLINE void EndTraceRecord( TraceRecord& Record, const Instruction& Instr, const Storage& Strg )
+{
+    if ( Instr.Form == OperandForm::Rel8 )
+    {
+        return;
+    }
+
+    MemoryAddress Address{ (uint32)Record.StoreSegment << 4, Record.StoreOffset };
+    Record.RegAfter = GetWrittenRegister( Strg.RegFile, Instr );
+    Record.StoreValue = ReadPhysical( Strg, GetPhysicalAddress( Address ) ) | ( ReadPhysical( Strg, GetPhysicalAddress( Address, 1 ) ) << 8 );
+
+    if ( Instr.Name != IName::MOV )
+    {
+        Record.Flags = EvaluateFlags( Strg.RegFile );
+    }
+}
+
+// Single-producer, single-consumer ring between the simulator and the thread that writes
+// the trace file. Head and Tail only ever grow; a slot is Index & ( Capacity - 1 ).
+struct TraceRing
+{
+    static constexpr uint32 Capacity = 1 << 16;
+
+    // Drained in chunks of at least this many records unless the run has finished
+    static constexpr uint32 WriteChunk = Capacity / 4;
+
+    TraceRecord Records[ Capacity ];
+    FILE* Output;
+
+    // Set by the writer when a write fails; read once it has been joined
+    bool Failed;
+
+    alignas( 64 ) std::atomic<uint64> Head;
+    uint64 CachedTail;
+
+    alignas( 64 ) std::atomic<uint64> Tail;
+    std::atomic<bool> Done;
+};
+
+// Only waits when the writer has fallen a whole ring behind
+FORCEINLINE void PushTraceRecord( TraceRing& Ring, const TraceRecord& Record )
+{
+    uint64 Head = Ring.Head.load( std::memory_order_relaxed );
+    while ( Head - Ring.CachedTail == TraceRing::Capacity )
+    {
+        Ring.CachedTail = Ring.Tail.load( std::memory_order_acquire );
+        if ( Head - Ring.CachedTail == TraceRing::Capacity )
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    Ring.Records[ Head & ( TraceRing::Capacity - 1 ) ] = Record;
+    Ring.Head.store( Head + 1, std::memory_order_release );
+}
+
+void DrainTraceRing( TraceRing& Ring )
+{
+    uint64 Tail = Ring.Tail.load( std::memory_order_relaxed );
+    for (;;)
+    {
+        bool Done = Ring.Done.load( std::memory_order_acquire );
+        uint64 Head = Ring.Head.load( std::memory_order_acquire );
+
+        if ( Head == Tail && Done )
+        {
+            break;
+        }
+
+        if ( Head - Tail < TraceRing::WriteChunk && !Done )
+        {
+            std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+            continue;
+        }
+
+        // Up to the end of the ring; a wrapped remainder goes out on the next pass
+        uint64 Slot = Tail & ( TraceRing::Capacity - 1 );
+        uint64 Count = std::min<uint64>( Head - Tail, TraceRing::Capacity - Slot );
+        if ( !Ring.Failed && Count != fwrite( &Ring.Records[ Slot ], sizeof( TraceRecord ), Count, Ring.Output ) )
+        {
+            // Keeps draining, so that the simulator never waits on a ring nobody empties
+            Ring.Failed = true;
+        }
+
+        Tail += Count;
+        Ring.Tail.store( Tail, std::memory_order_release );
+    }
+}
+
+// Prints a binary trace the way -trace full prints a run, minus the end-of-run summary
+int DecodeTrace( const char* FileName )
+{
+    FILE* InputFile = fopen( FileName, "rb" );
+    if ( !InputFile )
+    {
+        printf( "ERROR: cannot open %s!\n", FileName );
+        return -1;
+    }
+
+    char Magic[ sizeof( TraceFileMagic ) ] = {};
+    uint32 RecordSize = 0;
+    if ( 1 != fread( Magic, sizeof( Magic ), 1, InputFile ) || 1 != fread( &RecordSize, sizeof( RecordSize ), 1, InputFile )
+         || 0 != memcmp( Magic, TraceFileMagic, sizeof( Magic ) ) || RecordSize != sizeof( TraceRecord ) )
+    {
+        printf( "ERROR: %s is not a trace file!\n", FileName );
+        fclose( InputFile );
+        return -1;
+    }
+
+    ClockStats* Clocks = new ClockStats{};
+    std::vector<TraceRecord> Records( TraceRing::WriteChunk );
+
+    size_t Count = 0;
+    while ( ( Count = fread( Records.data(), sizeof( TraceRecord ), Records.size(), InputFile ) ) > 0 )
+    {
+        for ( size_t i = 0; i < Count; i++ )
+        {
+            const TraceRecord& Record = Records[i];
+            Instruction Instr = DecodeInstruction( Record.Bytes );
+            PrintInstruction( Instr );
+
+            if ( Instr.Form == OperandForm::Rel8 )
+            {
+                if ( !IsJumpImplemented( Instr.Name ) )
+                {
+                    printf( "ERROR: JMP instruction not implemented!\n" );
+                }
+
+                CountClocks<TraceLevel::Full>( *Clocks, Instr.Name, Record.BaseClocks, 0, 0 );
+            }
+            else
+            {
+                CountClocks<TraceLevel::Full>( *Clocks, Instr.Name, Record.BaseClocks, Record.EaClocks, Record.PenaltyClocks );
+
+                MemoryAddress Address{ (uint32)Record.StoreSegment << 4, Record.StoreOffset };
+                bool Stores = Instr.Form == OperandForm::MemReg || Instr.Form == OperandForm::MemImm || Instr.Form == OperandForm::MemSeg;
+
+                if ( Instr.Form == OperandForm::SegReg || Instr.Form == OperandForm::SegMem )
+                {
+                    printf( "%s: 0x%04x => 0x%04x\n", GSegTable[ Instr.Reg ], Record.RegBefore, Record.RegAfter );
+                }
+                else if ( Instr.Form == OperandForm::RegSeg )
+                {
+                    printf( "%s: 0x%04x => 0x%04x\n", GRegTableX[ Instr.RegMem ], Record.RegBefore, Record.RegAfter );
+                }
+                else if ( !Stores )
+                {
+                    if ( Instr.Name == IName::MOV && Instr.Form == OperandForm::RegMem )
+                    {
+                        printf( "%s = %d\n", GetRegisterName( Instr.Reg, Instr.Wide ), Record.RegAfter );
+                    }
+                    else if ( Instr.Name != IName::CMP )
+                    {
+                        printf( Instr.Wide ? "%s: 0x%04x => 0x%04x\n" : "%s: 0x%02x => 0x%02x\n", GetRegisterName( Instr.Reg, Instr.Wide ), Record.RegBefore, Record.RegAfter );
+                    }
+                }
+                else if ( Instr.Name != IName::CMP )
+                {
+                    printf( "Memory[%d] = %d\n", GetPhysicalAddress( Address ), Record.StoreValue & 0x00ff );
+                    if ( Instr.Wide )
+                    {
+                        printf( "Memory[%d] = %d\n", GetPhysicalAddress( Address, 1 ), Record.StoreValue >> 8 );
+                    }
+                }
+
+                if ( Instr.Name != IName::MOV )
+                {
+                    PrintFlags( Record.Flags );
+                }
+            }
+
+            printf( "----------------\n" );
+        }
+    }
+
+    delete Clocks;
+    fclose( InputFile );
+
+    return 0;
+}
+
+void PrintResultRecord( const char* Name, const RegisterFile& RegFile, uint64 MemoryHash );
+
+// Validation of a fast engine against a plain DecodeInstruction/ExecuteInstruction copy of the
+// same run. The engine calls CheckAgainstReference once it has retired at least NextCheck
+// instructions, the reference catches up to the same count and both states are compared.
+// Memory only has to be compared on pages either side has written.
+struct ReferenceChecker
+{
+    Storage* Reference;
+    DecodeCache* Cache;
+    uint16 ProgramSize;
+    uint64 Interval;
+    uint64 NextCheck;
+    uint64 Executed;
+    uint64 Checks;
+    bool Diverged;
+
+    // Pages written by either side since the start of the run
+    uint64 WrittenPages[ MemoryPageCount / 64 ];
+};
+
+void BeginReferenceCheck( ReferenceChecker& Checker, const Storage& Strg, uint64 Interval )
+{
+    Checker.Reference = TakeSnapshot( Strg );
+    Checker.Cache = new DecodeCache{};
+    Checker.ProgramSize = *(uint16*)&Strg.Memory[0];
+    Checker.Interval = Interval;
+    Checker.NextCheck = Interval;
+}
+
+void EndReferenceCheck( ReferenceChecker& Checker )
+{
+    delete Checker.Cache;
+    DeleteStorage( Checker.Reference );
+}
+
+bool CheckAgainstReference( ReferenceChecker& Checker, const Storage& Strg, uint64 InstructionCount )
+{
+    Storage& Ref = *Checker.Reference;
+    while ( Checker.Executed < InstructionCount && Ref.RegFile.IP < Checker.ProgramSize )
+    {
+        Instruction Instr = DecodeInstruction( Ref.Memory + 2 + Ref.RegFile.IP );
+        if ( Instr.Name == IName::UNKNOWN )
+        {
+            break;
+        }
+
+        ExecuteInstruction<TraceLevel::Summary>( Instr, Ref, *Checker.Cache );
+        Checker.Executed++;
+    }
+
+    Checker.Checks++;
+    Checker.NextCheck = InstructionCount + Checker.Interval;
+
+    int32 MemoryMismatch = -1;
+    for ( uint32 Page = 0; Page < MemoryPageCount && MemoryMismatch < 0; Page++ )
+    {
+        uint64 Bit = 1ull << ( Page & 63 );
+        Checker.WrittenPages[ Page >> 6 ] |= ( Strg.DirtyPages[ Page >> 6 ] | Ref.DirtyPages[ Page >> 6 ] ) & Bit;
+
+        uint32 Address = Page << MemoryPageShift;
+        if ( ( Checker.WrittenPages[ Page >> 6 ] & Bit ) && 0 != memcmp( &Strg.Memory[ Address ], &Ref.Memory[ Address ], 1 << MemoryPageShift ) )
+        {
+            while ( Strg.Memory[ Address ] == Ref.Memory[ Address ] )
+            {
+                Address++;
+            }
+
+            MemoryMismatch = (int32)Address;
+        }
+    }
+
+    // High pages are not tracked by DirtyPages and are few enough to compare whole
+    for ( uint32 Page = 0; Page < HighPageCount && MemoryMismatch < 0; Page++ )
+    {
+        const uint8* FastPage = GetHighPage( Strg, Page );
+        const uint8* RefPage = GetHighPage( Ref, Page );
+        if ( FastPage != RefPage && 0 != memcmp( FastPage, RefPage, HighPageSize ) )
+        {
+            uint32 Offset = 0;
+            while ( FastPage[ Offset ] == RefPage[ Offset ] )
+            {
+                Offset++;
+            }
+
+            MemoryMismatch = (int32)( ( 1 << 16 ) + ( Page << HighPageShift ) + Offset );
+        }
+    }
+
+    const RegisterFile& Fast = Strg.RegFile;
+    bool Matches = Checker.Executed == InstructionCount && MemoryMismatch < 0
+                   && 0 == memcmp( Fast.GPRs, Ref.RegFile.GPRs, sizeof( Fast.GPRs ) ) && Fast.IP == Ref.RegFile.IP
+                   && 0 == memcmp( Fast.Segs, Ref.RegFile.Segs, sizeof( Fast.Segs ) )
+                   && EvaluateFlags( Fast ) == EvaluateFlags( Ref.RegFile ) && Strg.Clocks.Total == Ref.Clocks.Total;
+    if ( Matches )
+    {
+        return true;
+    }
+
+    Checker.Diverged = true;
+
+    printf( "ERROR: engine diverged from the reference interpreter at IP %d after %llu instructions!\n", Fast.IP, (unsigned long long)InstructionCount );
+    PrintResultRecord( "engine   ", Fast, HashStorage( Strg ) );
+    PrintResultRecord( "reference", Ref.RegFile, HashStorage( Ref ) );
+    printf( "Clocks: engine %llu, reference %llu\n", (unsigned long long)Strg.Clocks.Total, (unsigned long long)Ref.Clocks.Total );
+
+    if ( Checker.Executed != InstructionCount )
+    {
+        printf( "Reference stopped after %llu instructions\n", (unsigned long long)Checker.Executed );
+    }
+
+    if ( MemoryMismatch >= 0 )
+    {
+        printf( "First memory difference at Memory[%d]: engine 0x%02x, reference 0x%02x\n",
+                MemoryMismatch, ReadPhysical( Strg, MemoryMismatch ), ReadPhysical( Ref, MemoryMismatch ) );
+    }
+
+    return false;
+}
+
+// Restarts a halted run from Image up to Remaining more times within one engine call, so that
+// -bench can time the runs themselves without the engine's setup or the restores in between.
+// Timing starts at the end of the first run, which warms the engine's caches up.
+struct RepeatRuns
+{
+    const Storage* Image;
+    uint32 Remaining;
+
+    uint32 Timed;
+    double Seconds;
+    std::chrono::steady_clock::time_point Start;
+};
+
+// Called once the run in Strg has halted; true when Strg has been reset for another run.
+// Decoded and translated code always matches memory, so it stays valid for the restored
+// image unless the run left its own code changed, and then the run is not repeated.
+bool RepeatRun( RepeatRuns* Repeat, Storage& Strg )
+{
+    if ( !Repeat )
+    {
+        return false;
+    }
+
+    auto EndTime = std::chrono::steady_clock::now();
+    if ( Repeat->Start != std::chrono::steady_clock::time_point{} )
+    {
+        Repeat->Seconds += std::chrono::duration<double>( EndTime - Repeat->Start ).count();
+        Repeat->Timed++;
+    }
+
+    const uint8* Image = Repeat->Image->Memory;
+    size_t CodeEnd = std::min<size_t>( 2 + *(const uint16*)Image + MaxInstructionSize, sizeof( Strg.Memory ) );
+    if ( !Repeat->Remaining || 0 != memcmp( Strg.Memory, Image, CodeEnd ) )
+    {
+        return false;
+    }
+
+    Repeat->Remaining--;
+    RestoreSnapshot( Strg, *Repeat->Image );
+    Repeat->Start = std::chrono::steady_clock::now();
+
+    return true;
+}
+
+// Optional observers of a run. Profile, Deltas, Trace and Frames are only supported by the
+// interpreter, Reference is checked by every engine and Repeat is honoured by every engine.
+struct RunHooks
+{
+    ProfileData* Profile;
+    DeltaStream* Deltas;
+    TraceRing* Trace;
+    FrameExport* Frames;
+    ReferenceChecker* Reference;
+    RepeatRuns* Repeat;
+};
+
+template <TraceLevel Level>
+uint64 Simulate8086( Storage& Strg, const RunHooks& Hooks )
+{
+    const uint16 ProgramSize = *(uint16*)&Strg.Memory[0];
+    uint64 InstructionCount = 0;
+
+    DecodeCache* Cache = new DecodeCache{};
+
+    for (;;)
+    {
+        const Instruction& Instr = FetchInstruction( *Cache, Strg.Memory, 2 + Strg.RegFile.IP );
+        if ( Instr.Name == IName::UNKNOWN )
+        {
+            printf( "ERROR: Unknown instruction 0x%02x at IP %d!\n", Strg.Memory[ 2 + Strg.RegFile.IP ], Strg.RegFile.IP );
+            break;
+        }
+
+        if constexpr ( Level == TraceLevel::Full )
+        {
+            PrintInstruction( Instr );
+        }
+
+        if ( Hooks.Profile )
+        {
+            ProfileInstruction( *Hooks.Profile, Instr, Strg.RegFile );
+        }
+
+        TraceRecord Record;
+        if ( Hooks.Trace )
+        {
+            BeginTraceRecord( Record, Instr, Strg );
+        }
+
+        ExecuteInstruction<Level>( Instr, Strg, *Cache );
+
+        if ( Hooks.Trace )
+        {
+            EndTraceRecord( Record, Instr, Strg );
+            PushTraceRecord( *Hooks.Trace, Record );
+        }
+
+        if ( DeltaStream* Deltas = Hooks.Deltas )
+        {
+            Deltas->Steps++;
+            if ( ++Deltas->Pending == Deltas->Interval )
+            {
+                Deltas->Pending = 0;
+                FlushDeltas( *Deltas, Strg );
+            }
+        }
+
+        if ( FrameExport* Frames = Hooks.Frames )
+        {
+            Frames->Steps++;
+            if ( GetFrameTime( *Frames, Strg ) >= Frames->NextFrame )
+            {
+                PollFrames( *Frames, Strg );
+            }
+        }
+
+        Trace<Level>( "----------------\n" );
+
+        if constexpr ( Level != TraceLevel::Off )
+        {
+            InstructionCount++;
+        }
+
+        if ( Hooks.Reference && InstructionCount >= Hooks.Reference->NextCheck && !CheckAgainstReference( *Hooks.Reference, Strg, InstructionCount ) )
+        {
+            break;
+        }
+
+        if ( Strg.RegFile.IP >= ProgramSize && !RepeatRun( Hooks.Repeat, Strg ) )
+        {
+            break;
+        }
+    }
+
+    if ( Hooks.Deltas && Hooks.Deltas->Pending )
+    {
+        FlushDeltas( *Hooks.Deltas, Strg );
+    }
+
+    if ( Hooks.Frames )
+    {
+        PollFrames( *Hooks.Frames, Strg );
+    }
+
+    if constexpr ( Level != TraceLevel::Off )
+    {
+        printf( "Decode cache: %llu hits, %llu misses, %llu invalidations\n",
+                (unsigned long long)Cache->Hits, (unsigned long long)Cache->Misses, (unsigned long long)Cache->Invalidations );
+    }
+
+    delete Cache;
+
+    return InstructionCount;
+}
+
+// Every executable (IName, OperandForm) pair and every jump, in IName then OperandForm order
+#define ALU_FORM_OPS( X ) \
+    X( MOV, RegReg ) X( MOV, RegImm ) X( MOV, MemReg ) X( MOV, MemImm ) X( MOV, RegMem ) \
+    X( ADD, RegReg ) X( ADD, RegImm ) X( ADD, MemReg ) X( ADD, MemImm ) X( ADD, RegMem ) \
+    X( SUB, RegReg ) X( SUB, RegImm ) X( SUB, MemReg ) X( SUB, MemImm ) X( SUB, RegMem ) \
+    X( CMP, RegReg ) X( CMP, RegImm ) X( CMP, MemReg ) X( CMP, MemImm ) X( CMP, RegMem )
+
+// MOVs to and from segment registers, in OperandForm order
+#define SEGMENT_FORM_OPS( X ) \
+    X( MOV, SegReg ) X( MOV, SegMem ) X( MOV, RegSeg ) X( MOV, MemSeg )
+
+#define JUMP_OPS( X ) \
+    X( JE ) X( JL ) X( JLE ) X( JB ) X( JBE ) X( JP ) X( JO ) X( JS ) X( JNE ) X( JNL ) \
+    X( JNLE ) X( JNB ) X( JNBE ) X( JNP ) X( JNO ) X( JNS ) X( LOOP ) X( LOOPZ ) X( LOOPNZ ) X( JCXZ )
+
+// Threaded-code engine: every decoded address is translated once into a ThreadedOp, and each
+// handler ends by dispatching straight to the handler of the next instruction (computed goto
+// where the compiler supports it, a switch otherwise).
+#define THREADED_ALU_ENUM( Name, Form ) Name##Form,
+#define THREADED_BYTE_ALU_ENUM( Name, Form ) Name##Form##8,
+#define THREADED_JUMP_ENUM( Name ) Name,
+
+enum class ThreadedOp : uint8
+{
+    Decode,
+    Unknown,
+    ALU_FORM_OPS( THREADED_ALU_ENUM )
+    JUMP_OPS( THREADED_JUMP_ENUM )
+    SEGMENT_FORM_OPS( THREADED_ALU_ENUM )
+    ALU_FORM_OPS( THREADED_BYTE_ALU_ENUM )
+};
+
+static_assert( (uint8)ThreadedOp::ADDRegReg - (uint8)ThreadedOp::MOVRegReg == (uint8)OperandForm::RegMem, "ALU ops are laid out by IName, then OperandForm" );
+static_assert( (uint8)ThreadedOp::JCXZ - (uint8)ThreadedOp::JE == (uint8)IName::JCXZ - (uint8)IName::JE, "Jump ops are laid out in IName order" );
+static_assert( (uint8)ThreadedOp::MOVMemSeg - (uint8)ThreadedOp::MOVSegReg == (uint8)OperandForm::MemSeg - (uint8)OperandForm::SegReg, "Segment ops are laid out in OperandForm order" );
+static_assert( (uint8)ThreadedOp::CMPRegMem8 - (uint8)ThreadedOp::MOVRegReg8 == (uint8)ThreadedOp::CMPRegMem - (uint8)ThreadedOp::MOVRegReg, "Byte ALU ops are laid out like the word ones" );
+
+ThreadedOp SelectThreadedOp( const Instruction& Instr )
+{
+    if ( Instr.Name == IName::UNKNOWN )
+    {
+        return ThreadedOp::Unknown;
+    }
+
+    if ( IsJump( Instr.Name ) )
+    {
+        return ThreadedOp( (uint8)ThreadedOp::JE + (uint8)Instr.Name - (uint8)IName::JE );
+    }
+
+    if ( IsSegmentForm( Instr.Form ) )
+    {
+        return ThreadedOp( (uint8)ThreadedOp::MOVSegReg + (uint8)Instr.Form - (uint8)OperandForm::SegReg );
+    }
+
+    uint8 FormCount = (uint8)OperandForm::RegMem;
+    uint8 First = Instr.Wide ? (uint8)ThreadedOp::MOVRegReg : (uint8)ThreadedOp::MOVRegReg8;
+    return ThreadedOp( First + (uint8)Instr.Name * FormCount + (uint8)Instr.Form - (uint8)OperandForm::RegReg );
+}
+
+#if defined( __GNUC__ )
+#define THREADED_COMPUTED_GOTO 1
+#define THREADED_HANDLER( Op ) Op_##Op:
+#define THREADED_DISPATCH() goto *Labels[ Op ]
+#define THREADED_LABEL( Name, ... ) &&Op_##Name##__VA_ARGS__,
+#else
+#define THREADED_COMPUTED_GOTO 0
+#define THREADED_HANDLER( Op ) case (uint8)ThreadedOp::Op:
+#define THREADED_DISPATCH() continue
+#endif
+
+// A translated op dispatches without going through FetchInstruction, so it counts its own
+// hit; ThreadedOp::Decode is counted by the FetchInstruction it makes
+template <TraceLevel Level>
+FORCEINLINE void CountThreadedHit( DecodeCache& Cache, uint8 Op )
+{
+    if constexpr ( Level != TraceLevel::Off )
+    {
+        Cache.Hits += Op != (uint8)ThreadedOp::Decode;
+    }
+}
+
+#define THREADED_NEXT() \
+    Trace<Level>( "----------------\n" ); \
+    if constexpr ( Level != TraceLevel::Off ) \
+    { \
+        InstructionCount++; \
+    } \
+    if ( RegFile.IP >= ProgramSize && !RepeatRun( Repeat, Strg ) ) \
+    { \
+        goto Done; \
+    } \
+    Address = 2 + RegFile.IP; \
+    Instr = &Cache->Entries[ Address ]; \
+    Op = Cache->ThreadedOps[ Address ]; \
+    CountThreadedHit<Level>( *Cache, Op ); \
+    THREADED_DISPATCH()
+
+#define THREADED_WIDTH_ALU_HANDLER( Name, Form, Wide, ... ) \
+    THREADED_HANDLER( Name##Form##__VA_ARGS__ ) \
+    { \
+        if constexpr ( Level == TraceLevel::Full ) \
+        { \
+            PrintInstruction( *Instr ); \
+        } \
+        ExecuteOperation<Level, Wide>( IName::Name, OperandForm::Form, *Instr, Strg, *Cache ); \
+        RegFile.IP += Instr->ByteSize; \
+        THREADED_NEXT(); \
+    }
+
+#define THREADED_ALU_HANDLER( Name, Form ) THREADED_WIDTH_ALU_HANDLER( Name, Form, true )
+#define THREADED_BYTE_ALU_HANDLER( Name, Form ) THREADED_WIDTH_ALU_HANDLER( Name, Form, false, 8 )
+#define THREADED_BYTE_LABEL( Name, Form ) THREADED_LABEL( Name, Form##8 )
+
+#define THREADED_JUMP_HANDLER( Name ) \
+    THREADED_HANDLER( Name ) \
+    { \
+        if constexpr ( Level == TraceLevel::Full ) \
+        { \
+            PrintInstruction( *Instr ); \
+        } \
+        RegFile.IP += Instr->ByteSize; \
+        ExecuteJump<Level>( *Instr, Strg ); \
+        if ( Reference && InstructionCount + 1 >= Reference->NextCheck && !CheckAgainstReference( *Reference, Strg, InstructionCount + 1 ) ) \
+        { \
+            goto Done; \
+        } \
+        THREADED_NEXT(); \
+    }
+
+template <TraceLevel Level>
+uint64 SimulateThreaded8086( Storage& Strg, ReferenceChecker* Reference, RepeatRuns* Repeat )
+{
+    const uint16 ProgramSize = *(uint16*)&Strg.Memory[0];
+    uint64 InstructionCount = 0;
+
+    RegisterFile& RegFile = Strg.RegFile;
+    DecodeCache* Cache = new DecodeCache{};
+
+    uint16 Address = 2 + RegFile.IP;
+    const Instruction* Instr = &Cache->Entries[ Address ];
+    uint8 Op = Cache->ThreadedOps[ Address ];
+    CountThreadedHit<Level>( *Cache, Op );
+
+#if THREADED_COMPUTED_GOTO
+    static const void* Labels[] = {
+        &&Op_Decode,
+        &&Op_Unknown,
+        ALU_FORM_OPS( THREADED_LABEL )
+        JUMP_OPS( THREADED_LABEL )
+        SEGMENT_FORM_OPS( THREADED_LABEL )
+        ALU_FORM_OPS( THREADED_BYTE_LABEL )
+    };
+
+    THREADED_DISPATCH();
+#else
+    for (;;)
+    {
+        switch ( Op )
+        {
+#endif
+
+    THREADED_HANDLER( Decode )
+    {
+        Instr = &FetchInstruction( *Cache, Strg.Memory, Address );
+        Op = (uint8)SelectThreadedOp( *Instr );
+        Cache->ThreadedOps[ Address ] = Op;
+        THREADED_DISPATCH();
+    }
+
+    THREADED_HANDLER( Unknown )
+    {
+        printf( "ERROR: Unknown instruction 0x%02x at IP %d!\n", Strg.Memory[ Address ], RegFile.IP );
+        goto Done;
+    }
+
+    ALU_FORM_OPS( THREADED_ALU_HANDLER )
+    JUMP_OPS( THREADED_JUMP_HANDLER )
+    SEGMENT_FORM_OPS( THREADED_ALU_HANDLER )
+    ALU_FORM_OPS( THREADED_BYTE_ALU_HANDLER )
+
+#if !THREADED_COMPUTED_GOTO
+        }
+    }
+#endif
+
+Done:
+    if constexpr ( Level != TraceLevel::Off )
+    {
+        printf( "Decode cache: %llu hits, %llu misses, %llu invalidations\n",
+                (unsigned long long)Cache->Hits, (unsigned long long)Cache->Misses, (unsigned long long)Cache->Invalidations );
+    }
+
+    delete Cache;
+
+    return InstructionCount;
+}
+
+// Flags each conditional jump reads, matching IsJumpTaken
+uint16 GetJumpFlagReads( IName Name )
+{
+    switch ( Name )
+    {
+    case IName::JO:
+    case IName::JNO:
+        return FlagOF;
+
+    case IName::JB:
+    case IName::JNB:
+        return FlagCF;
+
+    case IName::JE:
+    case IName::JNE:
+    case IName::LOOPZ:
+    case IName::LOOPNZ:
+        return FlagZF;
+
+    case IName::JBE:
+    case IName::JNBE:
+        return FlagCF | FlagZF;
+
+    case IName::JS:
+    case IName::JNS:
+        return FlagSF;
+
+    case IName::JP:
+    case IName::JNP:
+        return FlagPF;
+
+    case IName::JL:
+    case IName::JNL:
+        return FlagSF | FlagOF;
+
+    case IName::JLE:
+    case IName::JNLE:
+        return FlagZF | FlagSF | FlagOF;
+
+    default:
+        return 0;
+    }
+}
+
+constexpr uint16 FlagsAll = FlagCF | FlagPF | FlagAF | FlagZF | FlagSF | FlagOF;
+
+// Static control flow of the loaded program, recovered by following both edges of every
+// conditional jump from IP 0, with the flags that are live after each instruction. It only
+// describes the code as loaded: once a store changes any of it, it must be dropped, and flags
+// stay live across every store for the instructions that ran before the change.
+struct CfgBlock
+{
+    uint16 Start;
+    uint16 End;
+
+    // Instructions of the block in ControlFlowGraph::Instructions
+    uint32 FirstInstruction;
+    uint32 InstructionCount;
+
+    // Fall-through and taken successors as block indices, -1 if there is none. Exits is set
+    // when the run can end after the block: IP leaves the program or hits an unknown opcode.
+    int32 Successors[2];
+    bool Exits;
+
+    uint16 LiveIn;
+    uint16 LiveOut;
+};
+
+struct ControlFlowGraph
+{
+    std::vector<CfgBlock> Blocks;
+    std::vector<uint16> Instructions;
+
+    // Per IP: whether it was reached, and the flags live after the instruction there.
+    // IPs that were never reached keep every flag live.
+    std::vector<uint8> Reached;
+    std::vector<uint16> LiveOut;
+
+    uint32 Edges;
+    uint32 DeadFlagWrites;
+};
+
+constexpr uint32 NoSuccessor = 1 << 16;
+
+FORCEINLINE bool WritesFlags( const Instruction& Instr )
+{
+    return Instr.Name == IName::ADD || Instr.Name == IName::SUB || Instr.Name == IName::CMP;
+}
+
+bool IsStore( const Instruction& Instr )
+{
+    return Instr.Name != IName::CMP && ( Instr.Form == OperandForm::MemReg || Instr.Form == OperandForm::MemImm || Instr.Form == OperandForm::MemSeg );
+}
+
+// The byte ops that backends keeping only word registers still run: MOV stores of an
+// immediate or of AL..BL, which are the low bytes of AX..BX
+bool IsWordRegisterByteStore( const Instruction& Instr )
+{
+    return Instr.Name == IName::MOV && ( Instr.Form == OperandForm::MemImm || ( Instr.Form == OperandForm::MemReg && Instr.Reg < 4 ) );
+}
+
+ControlFlowGraph RecoverControlFlow( const uint8* Memory, uint16 ProgramSize )
+{
+    ControlFlowGraph Graph{};
+    Graph.Reached.assign( 1 << 16, 0 );
+    Graph.LiveOut.assign( 1 << 16, FlagsAll );
+
+    // Leaders are the entry, jump targets, the instruction after a jump and every IP that
+    // two differently aligned paths fall through into
+    std::vector<uint8> IsLeader( 1 << 16, 0 );
+    std::vector<uint8> FallIns( 1 << 16, 0 );
+    std::vector<uint16> Pending;
+
+    if ( ProgramSize )
+    {
+        IsLeader[0] = 1;
+        Pending.push_back( 0 );
+    }
+
+    while ( !Pending.empty() )
+    {
+        uint16 IP = Pending.back();
+        Pending.pop_back();
+
+        if ( IP >= ProgramSize || Graph.Reached[ IP ] )
+        {
+            continue;
+        }
+
+        Graph.Reached[ IP ] = 1;
+
+        Instruction Instr = DecodeInstruction( Memory + 2 + IP );
+        if ( Instr.Name == IName::UNKNOWN )
+        {
+            continue;
+        }
+
+        uint16 Next = IP + Instr.ByteSize;
+        Pending.push_back( Next );
+
+        if ( Instr.Form == OperandForm::Rel8 )
+        {
+            uint16 Target = Next + static_cast<int8>( Instr.Displacement );
+            IsLeader[ Target ] = 1;
+            IsLeader[ Next ] = 1;
+            Pending.push_back( Target );
+        }
+        else if ( FallIns[ Next ]++ )
+        {
+            IsLeader[ Next ] = 1;
+        }
+    }
+
+    // Block index + 1 at each leader, for resolving successors
+    std::vector<uint32> BlockAt( 1 << 16, 0 );
+    std::vector<uint32> SuccessorIPs;
+
+    for ( uint32 Start = 0; Start < ProgramSize; Start++ )
+    {
+        if ( !Graph.Reached[ Start ] || !IsLeader[ Start ] )
+        {
+            continue;
+        }
+
+        CfgBlock NewBlock{};
+        NewBlock.Start = (uint16)Start;
+        NewBlock.FirstInstruction = (uint32)Graph.Instructions.size();
+        NewBlock.Successors[0] = -1;
+        NewBlock.Successors[1] = -1;
+
+        uint32 Successors[2] = { NoSuccessor, NoSuccessor };
+
+        uint16 IP = (uint16)Start;
+        for (;;)
+        {
+            Instruction Instr = DecodeInstruction( Memory + 2 + IP );
+            if ( Instr.Name == IName::UNKNOWN )
+            {
+                NewBlock.Exits = true;
+                break;
+            }
+
+            Graph.Instructions.push_back( IP );
+            NewBlock.InstructionCount++;
+            IP += Instr.ByteSize;
+
+            if ( Instr.Form == OperandForm::Rel8 )
+            {
+                Successors[0] = IP;
+                Successors[1] = (uint16)( IP + static_cast<int8>( Instr.Displacement ) );
+                break;
+            }
+
+            if ( IP >= ProgramSize || IsLeader[ IP ] )
+            {
+                Successors[0] = IP;
+                break;
+            }
+        }
+
+        NewBlock.End = IP;
+        for ( uint32 Successor : Successors )
+        {
+            SuccessorIPs.push_back( Successor );
+        }
+
+        Graph.Blocks.push_back( NewBlock );
+        BlockAt[ Start ] = (uint32)Graph.Blocks.size();
+    }
+
+    for ( size_t i = 0; i < Graph.Blocks.size(); i++ )
+    {
+        CfgBlock& Node = Graph.Blocks[i];
+        for ( uint8 Slot = 0; Slot < 2; Slot++ )
+        {
+            uint32 Successor = SuccessorIPs[ i * 2 + Slot ];
+            if ( Successor == NoSuccessor || ( Slot == 1 && Successor == SuccessorIPs[ i * 2 ] ) )
+            {
+                continue;
+            }
+
+            if ( Successor >= ProgramSize )
+            {
+                Node.Exits = true;
+                continue;
+            }
+
+            Node.Successors[ Slot ] = (int32)BlockAt[ Successor ] - 1;
+            Graph.Edges++;
+        }
+    }
+
+    // Backward liveness to a fixpoint. Blocks are in IP order, so walking them in reverse
+    // settles straight-line code and forward jumps in one pass.
+    bool Changed = true;
+    while ( Changed )
+    {
+        Changed = false;
+        for ( size_t i = Graph.Blocks.size(); i-- > 0; )
+        {
+            CfgBlock& Node = Graph.Blocks[i];
+            uint16 Live = Node.Exits ? FlagsAll : 0;
+            for ( int32 Successor : Node.Successors )
+            {
+                if ( Successor >= 0 )
+                {
+                    Live |= Graph.Blocks[ Successor ].LiveIn;
+                }
+            }
+
+            Node.LiveOut = Live;
+
+            for ( uint32 j = Node.InstructionCount; j-- > 0; )
+            {
+                uint16 IP = Graph.Instructions[ Node.FirstInstruction + j ];
+                Instruction Instr = DecodeInstruction( Memory + 2 + IP );
+
+                // A store may rewrite the code that was going to overwrite the flags
+                if ( IsStore( Instr ) )
+                {
+                    Live = FlagsAll;
+                }
+
+                Graph.LiveOut[ IP ] = Live;
+
+                if ( WritesFlags( Instr ) )
+                {
+                    Live = 0;
+                }
+
+                Live |= GetJumpFlagReads( Instr.Name );
+            }
+
+            if ( Live != Node.LiveIn )
+            {
+                Node.LiveIn = Live;
+                Changed = true;
+            }
+        }
+    }
+
+    for ( uint16 IP : Graph.Instructions )
+    {
+        if ( WritesFlags( DecodeInstruction( Memory + 2 + IP ) ) && !Graph.LiveOut[ IP ] )
+        {
+            Graph.DeadFlagWrites++;
+        }
+    }
+
+    return Graph;
+}
+
+// Basic-block engine: code is split into blocks at jumps and jump targets and each block is
+// translated once into a run of BlockOps. An ALU op followed by the conditional jump that reads
+// its flags is fused into one op, and blocks link to their successors so that the lookup in
+// BlockAt only happens when a block exits somewhere new or code has been modified.
+struct BlockOp;
+
+using BlockHandler = bool (*)( const BlockOp& Op, Storage& Strg, DecodeCache& Cache );
+
+struct BlockOp
+{
+    BlockHandler Handler;
+    Instruction Instr;
+
+    // Conditional jump fused onto Instr, IName::UNKNOWN if there is none
+    Instruction Jump;
+};
+
+constexpr uint16 MaxBlockOps = 64;
+
+struct JitContext;
+
+using JitFunction = uint32 (*)( JitContext* Ctx );
+
+// A register after one loop iteration, as a function of the registers at the start of it:
+// ( Keeps ? own value : 0 ) + Delta + Scales[s] * GPRs[s], where every s with a nonzero scale
+// is a register the loop never writes
+struct LoopTerm
+{
+    bool Keeps;
+    uint16 Delta;
+    uint16 Scales[8];
+};
+
+// Closed form of a block that branches back to its own start with a fused "op counter / jnz"
+// and does nothing but word ALU ops on registers in between, e.g. "add bx, 10 / sub cx, 1 /
+// jnz". Test is the result the jnz reads, in the same terms as Regs.
+struct CountedLoop
+{
+    bool Valid;
+    uint8 Counter;
+    LoopTerm Regs[8];
+    LoopTerm Test;
+};
+
+struct Block
+{
+    uint16 Start;
+    uint16 End;
+    uint32 FirstOp;
+    uint32 OpCount;
+    uint32 InstructionCount;
+
+    // Linked successors at End (fall-through) and at the jump target, as BlockAt values
+    uint32 Successors[2];
+
+    // Run count towards JitThreshold and the compiled code, if any
+    uint32 ExecutionCount;
+    bool JitFailed;
+    JitFunction Native;
+
+    CountedLoop Loop;
+};
+
+struct BlockCache
+{
+    DecodeCache Decode;
+
+    // Index + 1 of the block starting at each IP, 0 if none has been translated
+    uint32 BlockAt[ 1 << 16 ];
+
+    // Jump targets found by FindBlockLeaders; blocks never run across one
+    bool IsLeader[ 1 << 16 ];
+
+    std::vector<Block> Blocks;
+    std::vector<BlockOp> Ops;
+
+    uint64 Translations;
+    uint64 FusedPairs;
+    uint64 Flushes;
+
+    uint64 FastForwards;
+    uint64 SkippedIterations;
+
+    // Flags live after each IP from RecoverControlFlow, null when every flag write has to be
+    // recorded: under a reference check, or once code has been modified
+    const uint16* LiveFlags;
+    uint64 DeadFlagOps;
+};
+
+template <TraceLevel Level, IName Name, OperandForm Form, bool Wide = true, bool RecordFlags = true>
+bool ExecuteBlockOp( const BlockOp& Op, Storage& Strg, DecodeCache& Cache )
+{
+    if constexpr ( Level == TraceLevel::Full )
+    {
+        PrintInstruction( Op.Instr );
+    }
+
+    uint64 Invalidations = Cache.Invalidations;
+
+    ExecuteOperation<Level, Wide, RecordFlags>( Name, Form, Op.Instr, Strg, Cache );
+    Strg.RegFile.IP += Op.Instr.ByteSize;
+
+    Trace<Level>( "----------------\n" );
+
+    // Only stores can modify code, and the rest of the block must not run if they did
+    if constexpr ( Form == OperandForm::MemReg || Form == OperandForm::MemImm || Form == OperandForm::MemSeg )
+    {
+        return Cache.Invalidations == Invalidations;
+    }
+
+    return true;
+}
+
+template <TraceLevel Level>
+bool ExecuteBlockJump( const BlockOp& Op, Storage& Strg, DecodeCache& )
+{
+    if constexpr ( Level == TraceLevel::Full )
+    {
+        PrintInstruction( Op.Instr );
+    }
+
+    Strg.RegFile.IP += Op.Instr.ByteSize;
+    ExecuteJump<Level>( Op.Instr, Strg );
+
+    Trace<Level>( "----------------\n" );
+
+    return true;
+}
+
+// Register ALU op and the conditional jump after it, e.g. "sub cx, 1 / jnz" or "cmp cx, 64 / jnz".
+// JumpName is IName::UNKNOWN for the variant that takes the condition from Op.Jump at run time.
+template <TraceLevel Level, IName AluName, OperandForm Form, IName JumpName>
+bool ExecuteFusedAluJump( const BlockOp& Op, Storage& Strg, DecodeCache& Cache )
+{
+    RegisterFile& RegFile = Strg.RegFile;
+
+    if constexpr ( Level == TraceLevel::Full )
+    {
+        PrintInstruction( Op.Instr );
+    }
+
+    ExecuteOperation<Level, true>( AluName, Form, Op.Instr, Strg, Cache );
+
+    Trace<Level>( "----------------\n" );
+
+    if constexpr ( Level == TraceLevel::Full )
+    {
+        PrintInstruction( Op.Jump );
+    }
+
+    constexpr bool IsGeneric = JumpName == IName::UNKNOWN;
+    RegFile.IP += Op.Instr.ByteSize + Op.Jump.ByteSize;
+
+    bool Taken = IsJumpTaken( IsGeneric ? Op.Jump.Name : JumpName, RegFile );
+    if ( Taken )
+    {
+        RegFile.IP += static_cast<int8>( Op.Jump.Displacement );
+    }
+
+    CountClocks<Level>( Strg.Clocks, IsGeneric ? Op.Jump.Name : JumpName, GetJumpClocks( IsGeneric ? Op.Jump.Name : JumpName, Taken ), 0, 0 );
+
+    Trace<Level>( "----------------\n" );
+
+    return true;
+}
+
+#define FUSABLE_OPS( X ) \
+    X( ADD, RegReg ) X( ADD, RegImm ) \
+    X( SUB, RegReg ) X( SUB, RegImm ) \
+    X( CMP, RegReg ) X( CMP, RegImm )
+
+// Word ops only; byte ops run on their own handlers and leave the jump unfused
+bool IsFusable( const Instruction& Instr )
+{
+    return Instr.Wide && ( Instr.Name == IName::ADD || Instr.Name == IName::SUB || Instr.Name == IName::CMP ) &&
+           ( Instr.Form == OperandForm::RegReg || Instr.Form == OperandForm::RegImm );
+}
+
+template <TraceLevel Level>
+BlockHandler SelectBlockHandler( const BlockOp& Op, bool RecordFlags )
+{
+#define BLOCK_ALU_HANDLER( Name, Form ) &ExecuteBlockOp<Level, IName::Name, OperandForm::Form>,
+#define BLOCK_WIDTH_HANDLERS( Name, Form ) \
+    &ExecuteBlockOp<Level, IName::Name, OperandForm::Form, true, true>, \
+    &ExecuteBlockOp<Level, IName::Name, OperandForm::Form, true, false>, \
+    &ExecuteBlockOp<Level, IName::Name, OperandForm::Form, false, true>, \
+    &ExecuteBlockOp<Level, IName::Name, OperandForm::Form, false, false>,
+#define BLOCK_FUSED_HANDLERS( Name, Form ) \
+    &ExecuteFusedAluJump<Level, IName::Name, OperandForm::Form, IName::JE>, \
+    &ExecuteFusedAluJump<Level, IName::Name, OperandForm::Form, IName::JNE>, \
+    &ExecuteFusedAluJump<Level, IName::Name, OperandForm::Form, IName::UNKNOWN>,
+
+    static constexpr BlockHandler AluHandlers[] = { ALU_FORM_OPS( BLOCK_WIDTH_HANDLERS ) };
+    static constexpr BlockHandler FusedHandlers[] = { FUSABLE_OPS( BLOCK_FUSED_HANDLERS ) };
+    static constexpr BlockHandler SegmentHandlers[] = { SEGMENT_FORM_OPS( BLOCK_ALU_HANDLER ) };
+
+#undef BLOCK_ALU_HANDLER
+#undef BLOCK_WIDTH_HANDLERS
+#undef BLOCK_FUSED_HANDLERS
+
+    const Instruction& Instr = Op.Instr;
+    if ( IsJump( Instr.Name ) )
+    {
+        return &ExecuteBlockJump<Level>;
+    }
+
+    if ( Op.Jump.Name != IName::UNKNOWN )
+    {
+        uint8 AluIndex = ( (uint8)Instr.Name - (uint8)IName::ADD ) * 2 + (uint8)Instr.Form - (uint8)OperandForm::RegReg;
+        uint8 JumpIndex = Op.Jump.Name == IName::JE ? 0 : Op.Jump.Name == IName::JNE ? 1 : 2;
+        return FusedHandlers[ AluIndex * 3 + JumpIndex ];
+    }
+
+    if ( IsSegmentForm( Instr.Form ) )
+    {
+        return SegmentHandlers[ (uint8)Instr.Form - (uint8)OperandForm::SegReg ];
+    }
+
+    uint8 FormCount = (uint8)OperandForm::RegMem;
+    uint8 AluIndex = (uint8)Instr.Name * FormCount + (uint8)Instr.Form - (uint8)OperandForm::RegReg;
+
+    return AluHandlers[ AluIndex * 4 + ( Instr.Wide ? 0 : 2 ) + ( RecordFlags ? 0 : 1 ) ];
+}
+
+void FindBlockLeaders( BlockCache& Cache, const uint8* Memory, uint16 ProgramSize )
+{
+    for ( uint32 IP = 0; IP < ProgramSize; )
+    {
+        Instruction Instr = DecodeInstruction( Memory + 2 + IP );
+        IP += Instr.ByteSize;
+
+        if ( Instr.Form == OperandForm::Rel8 )
+        {
+            Cache.IsLeader[ (uint16)( IP + static_cast<int8>( Instr.Displacement ) ) ] = true;
+        }
+    }
+}
+
+FORCEINLINE uint16 EvaluateLoopTerm( const LoopTerm& Term, const uint16* GPRs )
+{
+    uint16 Value = Term.Delta;
+    for ( uint8 Reg = 0; Reg < 8; Reg++ )
+    {
+        Value += (uint32)Term.Scales[ Reg ] * GPRs[ Reg ];
+    }
+
+    return Value;
+}
+
+// Applies "Name Dst, Src" to a term, where Src is an immediate or an invariant register
+void ApplyToLoopTerm( LoopTerm& Term, const Instruction& Instr )
+{
+    uint16 Sign = Instr.Name == IName::ADD ? 1 : UINT16_MAX;
+    if ( Instr.Name == IName::MOV )
+    {
+        Term = {};
+        Sign = 1;
+    }
+
+    if ( Instr.Form == OperandForm::RegImm )
+    {
+        Term.Delta += (uint32)Sign * Instr.Immediate;
+    }
+    else
+    {
+        Term.Scales[ Instr.RegMem ] += Sign;
+    }
+}
+
+CountedLoop AnalyzeCountedLoop( const Block& Source, const BlockOp* Ops )
+{
+    CountedLoop Loop{};
+
+    const BlockOp& Last = Ops[ Source.OpCount - 1 ];
+    if ( Last.Jump.Name != IName::JNE || (uint16)( Source.End + static_cast<int8>( Last.Jump.Displacement ) ) != Source.Start )
+    {
+        return Loop;
+    }
+
+    uint8 Written = 0;
+    for ( uint32 i = 0; i < Source.OpCount; i++ )
+    {
+        const Instruction& Instr = Ops[i].Instr;
+        if ( !Instr.Wide || ( Instr.Form != OperandForm::RegReg && Instr.Form != OperandForm::RegImm ) )
+        {
+            return Loop;
+        }
+
+        if ( Instr.Name != IName::CMP )
+        {
+            Written |= 1 << Instr.Reg;
+        }
+    }
+
+    // Sources that change within the loop would make the form nonlinear
+    for ( uint32 i = 0; i < Source.OpCount; i++ )
+    {
+        const Instruction& Instr = Ops[i].Instr;
+        if ( Instr.Form == OperandForm::RegReg && ( Written >> Instr.RegMem ) & 1 )
+        {
+            return Loop;
+        }
+    }
+
+    for ( LoopTerm& Term : Loop.Regs )
+    {
+        Term.Keeps = true;
+    }
+
+    for ( uint32 i = 0; i < Source.OpCount; i++ )
+    {
+        const Instruction& Instr = Ops[i].Instr;
+        if ( i == Source.OpCount - 1 )
+        {
+            Loop.Test = Loop.Regs[ Instr.Reg ];
+            ApplyToLoopTerm( Loop.Test, Instr );
+        }
+
+        if ( Instr.Name != IName::CMP )
+        {
+            ApplyToLoopTerm( Loop.Regs[ Instr.Reg ], Instr );
+        }
+    }
+
+    // A counter reloaded inside the loop tests the same value every iteration
+    Loop.Counter = Last.Instr.Reg;
+    Loop.Valid = Loop.Regs[ Loop.Counter ].Keeps;
+
+    return Loop;
+}
+
+// Runs all but the last iteration of a counted loop about to start at its first op in closed
+// form and returns how many that was. The last one runs normally and leaves the flags as
+// stepping would have, as nothing in the loop reads the flags of earlier iterations.
+template <TraceLevel Level>
+uint32 FastForwardLoop( const CountedLoop& Loop, const BlockOp* Ops, uint32 OpCount, Storage& Strg )
+{
+    uint16* GPRs = Strg.RegFile.GPRs;
+
+    // The jnz of iteration i + 1 reads Base + i * Step
+    uint16 Step = EvaluateLoopTerm( Loop.Regs[ Loop.Counter ], GPRs );
+    uint16 Base = GPRs[ Loop.Counter ] + EvaluateLoopTerm( Loop.Test, GPRs );
+    uint16 Target = -Base;
+    if ( Target == 0 || Step == 0 )
+    {
+        return 0;
+    }
+
+    // Solve Skip * Step == Target mod 2^16; no solution means the loop never ends
+    uint32 Shift = 0;
+    while ( !( ( Step >> Shift ) & 1 ) )
+    {
+        Shift++;
+    }
+
+    if ( Target & ( ( 1 << Shift ) - 1 ) )
+    {
+        return 0;
+    }
+
+    uint16 Odd = Step >> Shift;
+    uint16 Inverse = Odd;
+    for ( uint32 i = 0; i < 4; i++ )
+    {
+        Inverse = (uint32)Inverse * ( 2 - (uint32)Odd * Inverse );
+    }
+
+    uint16 Skip = (uint16)( (uint32)( Target >> Shift ) * Inverse ) & ( 0xffff >> Shift );
+
+    uint16 Start[8];
+    memcpy( Start, GPRs, sizeof( Start ) );
+    for ( uint8 Reg = 0; Reg < 8; Reg++ )
+    {
+        const LoopTerm& Term = Loop.Regs[ Reg ];
+        GPRs[ Reg ] = Term.Keeps ? Start[ Reg ] + (uint32)Skip * EvaluateLoopTerm( Term, Start ) : EvaluateLoopTerm( Term, Start );
+    }
+
+    if constexpr ( Level != TraceLevel::Off )
+    {
+        ClockStats& Clocks = Strg.Clocks;
+        for ( uint32 i = 0; i < OpCount; i++ )
+        {
+            const Instruction& Instr = Ops[i].Instr;
+            uint64 OpClocks = (uint64)Skip * GetBaseClocks( Instr.Name, Instr.Form );
+            Clocks.Total += OpClocks;
+            Clocks.Instructions[ (uint8)Instr.Name ] += Skip;
+            Clocks.Clocks[ (uint8)Instr.Name ] += OpClocks;
+        }
+
+        uint64 JumpClocks = (uint64)Skip * GetJumpClocks( IName::JNE, true );
+        Clocks.Total += JumpClocks;
+        Clocks.Instructions[ (uint8)IName::JNE ] += Skip;
+        Clocks.Clocks[ (uint8)IName::JNE ] += JumpClocks;
+    }
+
+    return Skip;
+}
+
+// Returns the new BlockAt value, or 0 if the first instruction cannot be decoded
+template <TraceLevel Level>
+uint32 TranslateBlock( BlockCache& Cache, const uint8* Memory, uint16 Start, uint16 ProgramSize )
+{
+    Block NewBlock{};
+    NewBlock.Start = Start;
+    NewBlock.FirstOp = (uint32)Cache.Ops.size();
+
+    uint16 IP = Start;
+    while ( NewBlock.OpCount < MaxBlockOps )
+    {
+        const Instruction& Instr = FetchInstruction( Cache.Decode, Memory, 2 + IP );
+        if ( Instr.Name == IName::UNKNOWN )
+        {
+            break;
+        }
+
+        BlockOp Op{};
+        Op.Instr = Instr;
+        uint16 InstrIP = IP;
+        IP += Instr.ByteSize;
+        NewBlock.InstructionCount++;
+
+        if ( IsFusable( Instr ) && IP < ProgramSize && !Cache.IsLeader[ IP ] )
+        {
+            const Instruction& Jump = FetchInstruction( Cache.Decode, Memory, 2 + IP );
+            if ( IsJumpImplemented( Jump.Name ) )
+            {
+                Op.Jump = Jump;
+                IP += Jump.ByteSize;
+                NewBlock.InstructionCount++;
+                Cache.FusedPairs++;
+            }
+        }
+
+        // Fused ops keep their flags for the jump, which reads them through RegisterFile
+        bool RecordFlags = !Cache.LiveFlags || Cache.LiveFlags[ InstrIP ] || Op.Jump.Name != IName::UNKNOWN;
+        if ( !RecordFlags && WritesFlags( Instr ) )
+        {
+            Cache.DeadFlagOps++;
+        }
+
+        Op.Handler = SelectBlockHandler<Level>( Op, RecordFlags );
+        Cache.Ops.push_back( Op );
+        NewBlock.OpCount++;
+
+        if ( IsJump( Op.Instr.Name ) || Op.Jump.Name != IName::UNKNOWN || IP >= ProgramSize || Cache.IsLeader[ IP ] )
+        {
+            break;
+        }
+    }
+
+    if ( NewBlock.OpCount == 0 )
+    {
+        return 0;
+    }
+
+    NewBlock.End = IP;
+    NewBlock.Loop = AnalyzeCountedLoop( NewBlock, &Cache.Ops[ NewBlock.FirstOp ] );
+    Cache.Blocks.push_back( NewBlock );
+    Cache.BlockAt[ Start ] = (uint32)Cache.Blocks.size();
+    Cache.Translations++;
+
+    return Cache.BlockAt[ Start ];
+}
+
+void FlushBlocks( BlockCache& Cache )
+{
+    for ( const Block& Translated : Cache.Blocks )
+    {
+        Cache.BlockAt[ Translated.Start ] = 0;
+    }
+
+    Cache.Blocks.clear();
+    Cache.Ops.clear();
+    Cache.Flushes++;
+
+    // Only a store to decoded code flushes, and liveness was computed for the old code
+    Cache.LiveFlags = nullptr;
+}
+
+// x86-64 backend for the block engine. A block that has run JitThreshold times is compiled
+// into native code that keeps AX..DI in r8w..r15w for the whole block, so only the first
+// entry and the exits touch RegisterFile. Stores that land on decoded code leave the block
+// right after the store so the caller can invalidate and retranslate.
+struct JitContext
+{
+    RegisterFile* RegFile = nullptr;
+    uint8* Memory = nullptr;
+    const uint8* CodeBytes = nullptr;
+
+    // Filled in by the native block before it returns
+    uint64 InstructionCount = 0;
+    uint16 StoreAddress = 0;
+    uint16 StoreSize = 0;
+
+    // Instructions after which a block that loops on itself returns to the host, set before
+    // each call
+    uint64 LoopBudget = 0;
+
+    // Pages stored to by native blocks, merged into Storage::DirtyPages after the run
+    uint64 DirtyPages[ MemoryPageCount / 64 ] = {};
+
+    // Accumulated by blocks compiled with clock counting, over the whole run
+    ClockStats Clocks = {};
+};
+
+// Moves what native blocks have accumulated in Ctx over to Strg
+void SyncJitContext( JitContext& Ctx, Storage& Strg )
+{
+    Strg.Clocks.Total += Ctx.Clocks.Total;
+    for ( uint8 i = 0; i < (uint8)IName::UNKNOWN; i++ )
+    {
+        Strg.Clocks.Instructions[i] += Ctx.Clocks.Instructions[i];
+        Strg.Clocks.Clocks[i] += Ctx.Clocks.Clocks[i];
+    }
+
+    for ( uint32 i = 0; i < MemoryPageCount / 64; i++ )
+    {
+        Strg.DirtyPages[i] |= Ctx.DirtyPages[i];
+    }
+
+    Ctx.Clocks = {};
+}
+
+constexpr uint32 JitBlockDone = 0;
+constexpr uint32 JitStoreToCode = 1;
+
+// A memory op at offset 0xFFFF wraps its second byte to offset 0, which native code does not
+// do; the block exits before the op and the caller interprets it
+constexpr uint32 JitInterpret = 2;
+
+constexpr uint32 JitThreshold = 16;
+
+// Bounds a native self-loop between returns to the host, when no validate point is nearer
+constexpr uint64 JitLoopBudget = 1 << 20;
+constexpr size_t JitBufferSize = 4 << 20;
+
+struct JitBuffer
+{
+    uint8* Code;
+    size_t Used;
+
+    uint64 CompiledBlocks;
+    uint64 NativeRuns;
+};
+
+bool CreateJitBuffer( JitBuffer& Buffer )
+{
+#if SIM_JIT_SUPPORTED
+    void* Code = mmap( nullptr, JitBufferSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( Code == MAP_FAILED )
+    {
+        printf( "ERROR: could not map executable memory, the JIT is disabled!\n" );
+        return false;
+    }
+
+    Buffer.Code = (uint8*)Code;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void DestroyJitBuffer( JitBuffer& Buffer )
+{
+#if SIM_JIT_SUPPORTED
+    if ( Buffer.Code )
+    {
+        munmap( Buffer.Code, JitBufferSize );
+    }
+#endif
+
+    Buffer.Code = nullptr;
+}
+
+struct JitEmitter
+{
+    uint8* Start;
+    uint8* Cursor;
+    uint8* Limit;
+};
+
+void Emit8( JitEmitter& E, uint8 Value )
+{
+    if ( E.Cursor < E.Limit )
+    {
+        *E.Cursor = Value;
+    }
+
+    E.Cursor++;
+}
+
+void Emit16( JitEmitter& E, uint16 Value )
+{
+    Emit8( E, (uint8)Value );
+    Emit8( E, (uint8)( Value >> 8 ) );
+}
+
+void Emit32( JitEmitter& E, uint32 Value )
+{
+    Emit16( E, (uint16)Value );
+    Emit16( E, (uint16)( Value >> 16 ) );
+}
+
+void EmitBytes( JitEmitter& E, std::initializer_list<uint8> Bytes )
+{
+    for ( uint8 Byte : Bytes )
+    {
+        Emit8( E, Byte );
+    }
+}
+
+// Emits a rel32 jump (Opcode is E9 or the second byte of a 0F 8x jcc) and returns the offset to patch
+size_t EmitJump( JitEmitter& E, uint8 Opcode )
+{
+    if ( Opcode != 0xE9 )
+    {
+        Emit8( E, 0x0F );
+    }
+
+    Emit8( E, Opcode );
+    Emit32( E, 0 );
+
+    return E.Cursor - E.Start - 4;
+}
+
+void PatchJump( JitEmitter& E, size_t Offset, size_t Target )
+{
+    int32 Rel = (int32)( Target - ( Offset + 4 ) );
+    if ( E.Start + Offset + 4 <= E.Limit )
+    {
+        memcpy( E.Start + Offset, &Rel, 4 );
+    }
+}
+
+constexpr uint8 JitRegFileGPRs = offsetof( RegisterFile, GPRs );
+constexpr uint8 JitRegFileIP = offsetof( RegisterFile, IP );
+constexpr uint8 JitRegFileLastFlagOp = offsetof( RegisterFile, LastFlagOp );
+constexpr uint8 JitRegFileFlagDst = offsetof( RegisterFile, FlagDst );
+constexpr uint8 JitRegFileFlagSrc = offsetof( RegisterFile, FlagSrc );
+constexpr uint8 JitRegFileFlags = offsetof( RegisterFile, Flags );
+
+// Host registers holding the operands of a recorded flag write: guest registers, or cx
+constexpr uint8 JitHostCX = 1;
+constexpr uint8 JitHostGuest = 8;
+constexpr uint8 JitHostImmediate = UINT8_MAX;
+
+// r/m16, r16 opcodes and the 0x81 group digits, indexed by IName (MOV, ADD, SUB, CMP)
+constexpr uint8 JitAluOpcodes[] = { 0x89, 0x01, 0x29, 0x39 };
+constexpr uint8 JitAluDigits[] = { 0, 0, 5, 7 };
+
+// eax = effective address of Instr, computed from the guest registers in r8w..r15w
+void EmitEffectiveAddress( JitEmitter& E, const Instruction& Instr )
+{
+    if ( Instr.RegMem & EaDirect )
+    {
+        Emit8( E, 0xB8 );
+        Emit32( E, Instr.Displacement );
+        return;
+    }
+
+    uint8 MemReg = Instr.RegMem & 0b111;
+    EmitBytes( E, { 0x41, 0x0F, 0xB7, uint8( 0xC0 | GMemRegTable1[ MemReg ] ) } );
+
+    if ( GMemRegTable2[ MemReg ] != UINT8_MAX )
+    {
+        EmitBytes( E, { 0x66, 0x44, 0x01, uint8( 0xC0 | GMemRegTable2[ MemReg ] << 3 ) } );
+    }
+
+    if ( Instr.Displacement )
+    {
+        EmitBytes( E, { 0x66, 0x05 } );
+        Emit16( E, Instr.Displacement );
+    }
+}
+
+// mov word [rdi + Offset], Host16
+void EmitStoreHost16( JitEmitter& E, uint8 Offset, uint8 Host )
+{
+    if ( Host >= 8 )
+    {
+        EmitBytes( E, { 0x66, 0x44, 0x89, uint8( 0x47 | ( Host & 7 ) << 3 ), Offset } );
+    }
+    else
+    {
+        EmitBytes( E, { 0x66, 0x89, uint8( 0x47 | Host << 3 ), Offset } );
+    }
+}
+
+// Records the operands of the following ALU op in RegisterFile, the same way SetFlags does.
+// Only plain stores, so the host flags of the op are still intact for a fused jump.
+void EmitRecordFlags( JitEmitter& E, const Instruction& Instr, uint8 DstHost, uint8 SrcHost )
+{
+    EmitStoreHost16( E, JitRegFileFlagDst, DstHost );
+
+    if ( SrcHost == JitHostImmediate )
+    {
+        EmitBytes( E, { 0x66, 0xC7, 0x47, JitRegFileFlagSrc } );
+        Emit16( E, Instr.Immediate );
+    }
+    else
+    {
+        EmitStoreHost16( E, JitRegFileFlagSrc, SrcHost );
+    }
+
+    FlagOp Op = Instr.Name == IName::ADD ? FlagOp::Add : FlagOp::Sub;
+    EmitBytes( E, { 0xC6, 0x47, JitRegFileLastFlagOp, (uint8)Op } );
+}
+
+// 8086 Jcc opcodes are 0x70 | cc with the same condition codes as host 0x0F 0x80 | cc,
+// indexed here from IName::JE
+constexpr uint8 GJumpConditionCodes[] = {
+    0x4, 0xC, 0xE, 0x2, 0x6, 0xA, 0x0, 0x8, 0x5, 0xD, 0xF, 0x3, 0x7, 0xB, 0x1, 0x9
+};
+
+// Jcc opcode (second byte) testing the host flags left by the fused ALU op
+uint8 JitFlagsCondition( IName Name )
+{
+    return 0x80 | GJumpConditionCodes[ (uint8)Name - (uint8)IName::JE ];
+}
+
+// Replays the operation recorded in RegisterFile to rebuild the host flags, or loads them
+// with popf if they are already evaluated, then emits a jump to the taken exit
+size_t EmitStoredCondition( JitEmitter& E, IName Name )
+{
+    // movzx eax, word [FlagDst]; cmp byte [LastFlagOp], Add; jne .sub
+    EmitBytes( E, { 0x0F, 0xB7, 0x47, JitRegFileFlagDst } );
+    EmitBytes( E, { 0x80, 0x7F, JitRegFileLastFlagOp, (uint8)FlagOp::Add, 0x75, 6 } );
+
+    // add ax, [FlagSrc]; jmp .test
+    EmitBytes( E, { 0x66, 0x03, 0x47, JitRegFileFlagSrc, 0xEB, 40 } );
+
+    // .sub: cmp byte [LastFlagOp], Sub; jne .add8; cmp ax, [FlagSrc]; jmp .test
+    EmitBytes( E, { 0x80, 0x7F, JitRegFileLastFlagOp, (uint8)FlagOp::Sub, 0x75, 6 } );
+    EmitBytes( E, { 0x66, 0x3B, 0x47, JitRegFileFlagSrc, 0xEB, 28 } );
+
+    // Byte ops are only run outside native code, but a block can start right after one
+    // .add8: cmp byte [LastFlagOp], Add8; jne .sub8; add al, [FlagSrc]; jmp .test
+    EmitBytes( E, { 0x80, 0x7F, JitRegFileLastFlagOp, (uint8)FlagOp::Add8, 0x75, 5 } );
+    EmitBytes( E, { 0x02, 0x47, JitRegFileFlagSrc, 0xEB, 17 } );
+
+    // .sub8: cmp byte [LastFlagOp], Sub8; jne .evaluated; cmp al, [FlagSrc]; jmp .test
+    EmitBytes( E, { 0x80, 0x7F, JitRegFileLastFlagOp, (uint8)FlagOp::Sub8, 0x75, 5 } );
+    EmitBytes( E, { 0x3A, 0x47, JitRegFileFlagSrc, 0xEB, 6 } );
+
+    // .evaluated: movzx eax, word [Flags]; push rax; popf
+    EmitBytes( E, { 0x0F, 0xB7, 0x47, JitRegFileFlags, 0x50, 0x9D } );
+
+    return EmitJump( E, JitFlagsCondition( Name ) );
+}
+
+bool IsJitSupported( const BlockOp& Op )
+{
+    if ( IsJump( Op.Instr.Name ) )
+    {
+        return IsJumpImplemented( Op.Instr.Name );
+    }
+
+    // The rest of the byte ops run on the byte handlers of the block engine
+    const Instruction& Instr = Op.Instr;
+    if ( !Instr.Wide && !IsWordRegisterByteStore( Instr ) )
+    {
+        return false;
+    }
+
+    return Instr.Name <= IName::CMP && Instr.Form >= OperandForm::RegReg && Instr.Form <= OperandForm::RegMem;
+}
+
+// Clocks of the ops a native exit has run, added to JitContext::Clocks by the exit. Only the
+// odd address penalty depends on run time values and is counted where it happens.
+struct JitClockTally
+{
+    uint32 Total;
+    uint32 Instructions[ (uint8)IName::UNKNOWN ];
+    uint32 Clocks[ (uint8)IName::UNKNOWN ];
+};
+
+void AddToTally( JitClockTally& Tally, IName Name, uint32 Clocks )
+{
+    Tally.Total += Clocks;
+    Tally.Instructions[ (uint8)Name ]++;
+    Tally.Clocks[ (uint8)Name ] += Clocks;
+}
+
+constexpr uint32 JitClocksTotal = offsetof( JitContext, Clocks ) + offsetof( ClockStats, Total );
+constexpr uint32 JitClocksInstructions = offsetof( JitContext, Clocks ) + offsetof( ClockStats, Instructions );
+constexpr uint32 JitClocksClocks = offsetof( JitContext, Clocks ) + offsetof( ClockStats, Clocks );
+
+// add qword [rbp + Offset], Value
+void EmitAddContext64( JitEmitter& E, uint32 Offset, uint32 Value )
+{
+    EmitBytes( E, { 0x48, 0x81, 0x85 } );
+    Emit32( E, Offset );
+    Emit32( E, Value );
+}
+
+void EmitClockTally( JitEmitter& E, const JitClockTally& Tally )
+{
+    EmitAddContext64( E, JitClocksTotal, Tally.Total );
+
+    for ( uint8 i = 0; i < (uint8)IName::UNKNOWN; i++ )
+    {
+        if ( Tally.Instructions[i] )
+        {
+            EmitAddContext64( E, JitClocksInstructions + i * 8, Tally.Instructions[i] );
+            EmitAddContext64( E, JitClocksClocks + i * 8, Tally.Clocks[i] );
+        }
+    }
+}
+
+// Adds the odd address penalty of a word access at eax, before the op sets the host flags
+void EmitOddAddressPenalty( JitEmitter& E, const Instruction& Instr )
+{
+    uint32 Penalty = 4 * GetTransferCount( Instr.Name, Instr.Form );
+
+    // test al, 1; jz past both adds
+    EmitBytes( E, { 0xA8, 0x01, 0x74, 22 } );
+    EmitAddContext64( E, JitClocksTotal, Penalty );
+    EmitAddContext64( E, JitClocksClocks + (uint8)Instr.Name * 8, Penalty );
+}
+
+// cmp ax, 0xFFFF; je to the exit that interprets the op, returning the offset to patch
+size_t EmitWrapGuard( JitEmitter& E )
+{
+    EmitBytes( E, { 0x66, 0x3D, 0xFF, 0xFF } );
+    return EmitJump( E, 0x84 );
+}
+
+// Emits one MOV/ADD/SUB/CMP and, if asked to, records its flags in RegisterFile. Returns the
+// patch offset of the jump taken when a store hits decoded code, or 0 if there is no store.
+// Memory ops also set WrapExit to the patch offset of their wrap guard.
+size_t EmitAluOp( JitEmitter& E, const Instruction& Instr, bool MaterializeFlags, bool CountClocks, size_t& WrapExit )
+{
+    uint8 Name = (uint8)Instr.Name;
+    uint8 Reg = Instr.Reg;
+
+    MaterializeFlags = MaterializeFlags && Instr.Name != IName::MOV;
+
+    switch ( Instr.Form )
+    {
+    case OperandForm::RegReg:
+        if ( MaterializeFlags )
+        {
+            EmitRecordFlags( E, Instr, JitHostGuest + Reg, JitHostGuest + Instr.RegMem );
+        }
+
+        EmitBytes( E, { 0x66, 0x45, JitAluOpcodes[ Name ], uint8( 0xC0 | Instr.RegMem << 3 | Reg ) } );
+        break;
+
+    case OperandForm::RegImm:
+        if ( Instr.Name == IName::MOV )
+        {
+            EmitBytes( E, { 0x66, 0x41, uint8( 0xB8 + Reg ) } );
+        }
+        else
+        {
+            if ( MaterializeFlags )
+            {
+                EmitRecordFlags( E, Instr, JitHostGuest + Reg, JitHostImmediate );
+            }
+
+            EmitBytes( E, { 0x66, 0x41, 0x81, uint8( 0xC0 | JitAluDigits[ Name ] << 3 | Reg ) } );
+        }
+
+        Emit16( E, Instr.Immediate );
+        break;
+
+    case OperandForm::RegMem:
+        EmitEffectiveAddress( E, Instr );
+        WrapExit = EmitWrapGuard( E );
+        if ( CountClocks && Instr.Wide )
+        {
+            EmitOddAddressPenalty( E, Instr );
+        }
+
+        EmitBytes( E, { 0x0F, 0xB7, 0x0C, 0x03 } );
+        if ( MaterializeFlags )
+        {
+            EmitRecordFlags( E, Instr, JitHostGuest + Reg, JitHostCX );
+        }
+
+        EmitBytes( E, { 0x66, 0x41, JitAluOpcodes[ Name ], uint8( 0xC8 | Reg ) } );
+        break;
+
+    case OperandForm::MemReg:
+    case OperandForm::MemImm:
+        {
+            EmitEffectiveAddress( E, Instr );
+            WrapExit = EmitWrapGuard( E );
+            if ( CountClocks && Instr.Wide )
+            {
+                EmitOddAddressPenalty( E, Instr );
+            }
+
+            if ( Instr.Name == IName::MOV && Instr.Form == OperandForm::MemReg )
+            {
+                if ( Instr.Wide )
+                {
+                    EmitBytes( E, { 0x66, 0x44, 0x89, uint8( Reg << 3 | 0x04 ), 0x03 } );
+                }
+                else
+                {
+                    EmitBytes( E, { 0x44, 0x88, uint8( Reg << 3 | 0x04 ), 0x03 } );
+                }
+            }
+            else if ( Instr.Name == IName::MOV )
+            {
+                if ( Instr.Wide )
+                {
+                    EmitBytes( E, { 0x66, 0xC7, 0x04, 0x03 } );
+                    Emit16( E, Instr.Immediate );
+                }
+                else
+                {
+                    EmitBytes( E, { 0xC6, 0x04, 0x03, (uint8)Instr.Immediate } );
+                }
+            }
+            else
+            {
+                // Read-modify-write on cx, only ever a word as byte ALU ops are not compiled
+                EmitBytes( E, { 0x0F, 0xB7, 0x0C, 0x03 } );
+                if ( MaterializeFlags )
+                {
+                    uint8 SrcHost = Instr.Form == OperandForm::MemReg ? JitHostGuest + Reg : JitHostImmediate;
+                    EmitRecordFlags( E, Instr, JitHostCX, SrcHost );
+                }
+
+                if ( Instr.Form == OperandForm::MemReg )
+                {
+                    EmitBytes( E, { 0x66, 0x44, JitAluOpcodes[ Name ], uint8( 0xC1 | Reg << 3 ) } );
+                }
+                else
+                {
+                    EmitBytes( E, { 0x66, 0x81, uint8( 0xC1 | JitAluDigits[ Name ] << 3 ) } );
+                    Emit16( E, Instr.Immediate );
+                }
+
+                if ( Instr.Name != IName::CMP )
+                {
+                    EmitBytes( E, { 0x66, 0x89, 0x0C, 0x03 } );
+                }
+            }
+
+            if ( !IsStore( Instr ) )
+            {
+                break;
+            }
+
+            // movzx ecx, ah; bts [rbp + DirtyPages], rcx, and again from lea ecx, [rax + 1] for words
+            EmitBytes( E, { 0x0F, 0xB6, 0xCC, 0x48, 0x0F, 0xAB, 0x4D, (uint8)offsetof( JitContext, DirtyPages ) } );
+            if ( Instr.Wide )
+            {
+                EmitBytes( E, { 0x8D, 0x48, 0x01, 0x0F, 0xB6, 0xCD, 0x48, 0x0F, 0xAB, 0x4D, (uint8)offsetof( JitContext, DirtyPages ) } );
+            }
+
+            // cmp byte/word [rsi + rax], 0 against the decoded-code map
+            if ( Instr.Wide )
+            {
+                EmitBytes( E, { 0x66, 0x83, 0x3C, 0x06, 0x00 } );
+            }
+            else
+            {
+                EmitBytes( E, { 0x80, 0x3C, 0x06, 0x00 } );
+            }
+
+            return EmitJump( E, 0x85 );
+        }
+
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+// Sets IP, the executed instruction count and the clocks if counted, then jumps to the
+// shared exit
+size_t EmitExit( JitEmitter& E, uint16 IP, uint32 InstructionCount, uint32 Status, uint16 StoreSize, const JitClockTally* Tally )
+{
+    EmitBytes( E, { 0x66, 0xC7, 0x47, JitRegFileIP } );
+    Emit16( E, IP );
+
+    if ( Tally )
+    {
+        EmitClockTally( E, *Tally );
+    }
+
+    // rdx counts the instructions of completed loop iterations
+    EmitBytes( E, { 0x48, 0x81, 0xC2 } );
+    Emit32( E, InstructionCount );
+    EmitBytes( E, { 0x48, 0x89, 0x55, (uint8)offsetof( JitContext, InstructionCount ) } );
+
+    if ( StoreSize )
+    {
+        EmitBytes( E, { 0x66, 0x89, 0x45, (uint8)offsetof( JitContext, StoreAddress ) } );
+        EmitBytes( E, { 0x66, 0xC7, 0x45, (uint8)offsetof( JitContext, StoreSize ) } );
+        Emit16( E, StoreSize );
+    }
+
+    if ( Status != JitBlockDone )
+    {
+        Emit8( E, 0xB8 );
+        Emit32( E, Status );
+    }
+    else
+    {
+        EmitBytes( E, { 0x31, 0xC0 } );
+    }
+
+    return EmitJump( E, 0xE9 );
+}
+
+struct JitFixup
+{
+    size_t Offset;
+    uint16 IP;
+    uint32 InstructionCount;
+    uint32 Status;
+    uint16 StoreSize;
+    JitClockTally Tally;
+};
+
+JitFunction CompileBlock( JitBuffer& Buffer, const Block& Source, const BlockOp* Ops, bool CountClocks, bool FlagsLiveAtEnd )
+{
+#if SIM_JIT_SUPPORTED
+    for ( uint32 i = 0; i < Source.OpCount; i++ )
+    {
+        if ( !IsJitSupported( Ops[i] ) )
+        {
+            return nullptr;
+        }
+    }
+
+    // Only the last flag write before an exit has to reach RegisterFile; host flags carry
+    // the rest. Every store is a potential exit, and an unfused jump reads RegisterFile.
+    bool Materialize[ MaxBlockOps ] = {};
+    bool FlagsLive = FlagsLiveAtEnd || IsJump( Ops[ Source.OpCount - 1 ].Instr.Name );
+    for ( uint32 i = Source.OpCount; i-- > 0; )
+    {
+        const Instruction& Instr = Ops[i].Instr;
+        if ( IsStore( Instr ) )
+        {
+            FlagsLive = true;
+        }
+
+        if ( Instr.Name != IName::MOV && !IsJump( Instr.Name ) )
+        {
+            Materialize[i] = FlagsLive;
+            FlagsLive = false;
+        }
+
+        // The wrap guard exits before the op
+        if ( IsMemoryForm( Instr.Form ) )
+        {
+            FlagsLive = true;
+        }
+    }
+
+    JitEmitter E{ Buffer.Code + Buffer.Used, Buffer.Code + Buffer.Used, Buffer.Code + JitBufferSize };
+
+    // push rbx, rbp, r12..r15; rbp = Ctx; rdi = RegFile; rbx = Memory; rsi = CodeBytes
+    EmitBytes( E, { 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 } );
+    EmitBytes( E, { 0x48, 0x89, 0xFD } );
+    EmitBytes( E, { 0x48, 0x8B, 0x7D, (uint8)offsetof( JitContext, RegFile ) } );
+    EmitBytes( E, { 0x48, 0x8B, 0x5D, (uint8)offsetof( JitContext, Memory ) } );
+    EmitBytes( E, { 0x48, 0x8B, 0x75, (uint8)offsetof( JitContext, CodeBytes ) } );
+
+    for ( uint8 Reg = 0; Reg < 8; Reg++ )
+    {
+        EmitBytes( E, { 0x44, 0x0F, 0xB7, uint8( 0x47 | Reg << 3 ), uint8( JitRegFileGPRs + Reg * 2 ) } );
+    }
+
+    EmitBytes( E, { 0x31, 0xD2 } );
+    size_t BodyOffset = E.Cursor - E.Start;
+
+    std::vector<JitFixup> Exits;
+    uint16 IP = Source.Start;
+    uint32 InstructionCount = 0;
+    size_t TakenOffset = 0;
+    uint16 TakenIP = 0;
+    JitClockTally Tally{};
+    JitClockTally TakenTally{};
+
+    for ( uint32 i = 0; i < Source.OpCount; i++ )
+    {
+        const BlockOp& Op = Ops[i];
+        const Instruction* Jump = nullptr;
+
+        if ( IsJump( Op.Instr.Name ) )
+        {
+            Jump = &Op.Instr;
+        }
+        else
+        {
+            size_t WrapExit = 0;
+            JitClockTally Before = Tally;
+            size_t StoreExit = EmitAluOp( E, Op.Instr, Materialize[i], CountClocks, WrapExit );
+            if ( WrapExit )
+            {
+                Exits.push_back( { WrapExit, IP, InstructionCount, JitInterpret, 0, Before } );
+            }
+
+            IP += Op.Instr.ByteSize;
+            InstructionCount++;
+
+            uint32 Ea = IsMemoryForm( Op.Instr.Form ) ? GetEaClocks( Op.Instr.RegMem ) : 0;
+            AddToTally( Tally, Op.Instr.Name, GetBaseClocks( Op.Instr.Name, Op.Instr.Form ) + Ea );
+
+            if ( StoreExit )
+            {
+                Exits.push_back( { StoreExit, IP, InstructionCount, JitStoreToCode, uint16( Op.Instr.Wide ? 2 : 1 ), Tally } );
+            }
+
+            if ( Op.Jump.Name != IName::UNKNOWN )
+            {
+                Jump = &Op.Jump;
+            }
+        }
+
+        if ( Jump )
+        {
+            IP += Jump->ByteSize;
+            InstructionCount++;
+            TakenIP = IP + static_cast<int8>( Jump->Displacement );
+
+            bool Fused = Jump == &Op.Jump;
+            TakenOffset = Fused ? EmitJump( E, JitFlagsCondition( Jump->Name ) ) : EmitStoredCondition( E, Jump->Name );
+
+            TakenTally = Tally;
+            AddToTally( TakenTally, Jump->Name, GetJumpClocks( Jump->Name, true ) );
+            AddToTally( Tally, Jump->Name, GetJumpClocks( Jump->Name, false ) );
+        }
+    }
+
+    // Fall-through exit, then the taken exit and the store exits
+    Exits.push_back( { EmitExit( E, IP, InstructionCount, JitBlockDone, 0, CountClocks ? &Tally : nullptr ), 0, 0, JitBlockDone, 0, {} } );
+
+    if ( TakenOffset )
+    {
+        PatchJump( E, TakenOffset, E.Cursor - E.Start );
+
+        if ( TakenIP == Source.Start )
+        {
+            // A block that jumps to itself loops natively until Ctx->LoopBudget instructions
+            // have run, then returns to the host at its own start
+            EmitBytes( E, { 0x48, 0x81, 0xC2 } );
+            Emit32( E, InstructionCount );
+            if ( CountClocks )
+            {
+                EmitClockTally( E, TakenTally );
+            }
+
+            EmitBytes( E, { 0x48, 0x3B, 0x55, (uint8)offsetof( JitContext, LoopBudget ) } );
+            size_t BudgetOffset = EmitJump( E, 0x83 );
+            PatchJump( E, EmitJump( E, 0xE9 ), BodyOffset );
+
+            PatchJump( E, BudgetOffset, E.Cursor - E.Start );
+            Exits.push_back( { EmitExit( E, Source.Start, 0, JitBlockDone, 0, nullptr ), 0, 0, JitBlockDone, 0, {} } );
+        }
+        else
+        {
+            Exits.push_back( { EmitExit( E, TakenIP, InstructionCount, JitBlockDone, 0, CountClocks ? &TakenTally : nullptr ), 0, 0, JitBlockDone, 0, {} } );
+        }
+    }
+
+    std::vector<size_t> ExitJumps;
+    for ( const JitFixup& Exit : Exits )
+    {
+        if ( Exit.Status != JitBlockDone )
+        {
+            PatchJump( E, Exit.Offset, E.Cursor - E.Start );
+            ExitJumps.push_back( EmitExit( E, Exit.IP, Exit.InstructionCount, Exit.Status, Exit.StoreSize, CountClocks ? &Exit.Tally : nullptr ) );
+        }
+        else
+        {
+            ExitJumps.push_back( Exit.Offset );
+        }
+    }
+
+    // Shared exit: write the guest registers back and return the status in eax
+    for ( size_t Offset : ExitJumps )
+    {
+        PatchJump( E, Offset, E.Cursor - E.Start );
+    }
+
+    for ( uint8 Reg = 0; Reg < 8; Reg++ )
+    {
+        EmitBytes( E, { 0x66, 0x44, 0x89, uint8( 0x47 | Reg << 3 ), uint8( JitRegFileGPRs + Reg * 2 ) } );
+    }
+
+    EmitBytes( E, { 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3 } );
+
+    if ( E.Cursor > E.Limit )
+    {
+        return nullptr;
+    }
+
+    Buffer.Used += E.Cursor - E.Start;
+    Buffer.CompiledBlocks++;
+
+    return (JitFunction)E.Start;
+#else
+    return nullptr;
+#endif
+}
+
+template <TraceLevel Level>
+uint64 SimulateBlocks8086( Storage& Strg, bool EnableJit, ReferenceChecker* Reference, RepeatRuns* Repeat )
+{
+    const uint16 ProgramSize = *(uint16*)&Strg.Memory[0];
+    uint64 InstructionCount = 0;
+
+    RegisterFile& RegFile = Strg.RegFile;
+    BlockCache* Cache = new BlockCache{};
+
+    FindBlockLeaders( *Cache, Strg.Memory, ProgramSize );
+
+    // Flag writes nothing reads are skipped, except where every instruction's flags are
+    // printed or compared. All reachable code is decoded up front so that any store that
+    // changes it shows up as an invalidation and drops the liveness with the flush.
+    ControlFlowGraph Flow;
+    if ( Level != TraceLevel::Full && !Reference )
+    {
+        Flow = RecoverControlFlow( Strg.Memory, ProgramSize );
+        for ( uint16 IP : Flow.Instructions )
+        {
+            FetchInstruction( Cache->Decode, Strg.Memory, 2 + IP );
+        }
+
+        Cache->LiveFlags = Flow.LiveOut.data();
+    }
+
+    // Traced runs have to print every instruction, so they stay interpreted
+    JitBuffer Jit{};
+    if ( Level != TraceLevel::Full && EnableJit )
+    {
+        CreateJitBuffer( Jit );
+    }
+
+    JitContext Ctx{ &RegFile, Strg.Memory, Cache->Decode.CodeBytes };
+
+    // Block and successor slot to link once the block at IP has been translated
+    uint32 Prev = 0;
+    uint8 PrevSlot = 0;
+
+    while ( RegFile.IP < ProgramSize || RepeatRun( Repeat, Strg ) )
+    {
+        uint32 Current = Cache->BlockAt[ RegFile.IP ];
+        if ( !Current )
+        {
+            Current = TranslateBlock<Level>( *Cache, Strg.Memory, RegFile.IP, ProgramSize );
+            if ( !Current )
+            {
+                printf( "ERROR: Unknown instruction 0x%02x at IP %d!\n", Strg.Memory[ 2 + RegFile.IP ], RegFile.IP );
+                break;
+            }
+        }
+
+        if ( Prev )
+        {
+            Cache->Blocks[ Prev - 1 ].Successors[ PrevSlot ] = Current;
+            Prev = 0;
+        }
+
+        for (;;)
+        {
+            Block& Running = Cache->Blocks[ Current - 1 ];
+            const BlockOp* First = &Cache->Ops[ Running.FirstOp ];
+            const BlockOp* Last = First + Running.OpCount;
+
+            // Traced runs have to print every iteration
+            if ( Level != TraceLevel::Full && Running.Loop.Valid )
+            {
+                uint32 Skipped = FastForwardLoop<Level>( Running.Loop, First, Running.OpCount, Strg );
+                if ( Skipped )
+                {
+                    Cache->FastForwards++;
+                    Cache->SkippedIterations += Skipped;
+
+                    if constexpr ( Level != TraceLevel::Off )
+                    {
+                        InstructionCount += (uint64)Skipped * Running.InstructionCount;
+                    }
+                }
+            }
+
+            // Native code addresses the first 64KB directly, so it only runs with DS and SS at 0
+            if ( Running.Native && RegFile.Segs[ SegDS ] == 0 && RegFile.Segs[ SegSS ] == 0 )
+            {
+                Jit.NativeRuns++;
+
+                // A self-loop has to come back by the next validate point
+                Ctx.LoopBudget = JitLoopBudget;
+                if ( Reference )
+                {
+                    Ctx.LoopBudget = std::min( JitLoopBudget, Reference->NextCheck > InstructionCount ? Reference->NextCheck - InstructionCount : 1 );
+                }
+
+                uint32 Status = Running.Native( &Ctx );
+
+                if constexpr ( Level != TraceLevel::Off )
+                {
+                    InstructionCount += Ctx.InstructionCount;
+                }
+
+                if ( Status == JitStoreToCode )
+                {
+                    uint64 Invalidations = Cache->Decode.Invalidations;
+                    InvalidateDecodeCache( Cache->Decode, Ctx.StoreAddress, Ctx.StoreSize );
+
+                    if ( Cache->Decode.Invalidations != Invalidations )
+                    {
+                        FlushBlocks( *Cache );
+                        Jit.Used = 0;
+                    }
+
+                    break;
+                }
+
+                if ( Status == JitInterpret )
+                {
+                    // IP is now inside the block, so it continues from a fresh lookup
+                    uint64 Invalidations = Cache->Decode.Invalidations;
+                    const Instruction& Instr = FetchInstruction( Cache->Decode, Strg.Memory, 2 + RegFile.IP );
+                    ExecuteInstruction<Level>( Instr, Strg, Cache->Decode );
+
+                    if constexpr ( Level != TraceLevel::Off )
+                    {
+                        InstructionCount++;
+                    }
+
+                    if ( Cache->Decode.Invalidations != Invalidations )
+                    {
+                        FlushBlocks( *Cache );
+                        Jit.Used = 0;
+                    }
+
+                    break;
+                }
+            }
+            else
+            {
+                if ( Jit.Code && !Running.Native && !Running.JitFailed && ++Running.ExecutionCount >= JitThreshold )
+                {
+                    // The last instruction decides for both exits, as its live flags are theirs
+                    bool FlagsLiveAtEnd = true;
+                    if ( Cache->LiveFlags )
+                    {
+                        const BlockOp& Final = *( Last - 1 );
+                        uint16 FinalIP = Running.End - ( Final.Jump.Name != IName::UNKNOWN ? Final.Jump.ByteSize : Final.Instr.ByteSize );
+                        FlagsLiveAtEnd = Cache->LiveFlags[ FinalIP ] != 0;
+                    }
+
+                    Running.Native = CompileBlock( Jit, Running, First, Level != TraceLevel::Off, FlagsLiveAtEnd );
+                    Running.JitFailed = !Running.Native;
+                }
+
+                const BlockOp* Op = First;
+                while ( Op != Last && Op->Handler( *Op, Strg, Cache->Decode ) )
+                {
+                    Op++;
+                }
+
+                if ( Op != Last )
+                {
+                    // A store hit translated code: count what ran and retranslate from IP
+                    if constexpr ( Level != TraceLevel::Off )
+                    {
+                        for ( const BlockOp* Ran = First; Ran <= Op; Ran++ )
+                        {
+                            InstructionCount += Ran->Jump.Name != IName::UNKNOWN ? 2 : 1;
+                        }
+                    }
+
+                    FlushBlocks( *Cache );
+                    Jit.Used = 0;
+                    break;
+                }
+
+                if constexpr ( Level != TraceLevel::Off )
+                {
+                    InstructionCount += Running.InstructionCount;
+                }
+            }
+
+            if ( Reference && InstructionCount >= Reference->NextCheck )
+            {
+                SyncJitContext( Ctx, Strg );
+                if ( !CheckAgainstReference( *Reference, Strg, InstructionCount ) )
+                {
+                    goto Done;
+                }
+            }
+
+            if ( RegFile.IP >= ProgramSize )
+            {
+                break;
+            }
+
+            uint8 Slot = RegFile.IP == Running.End ? 0 : 1;
+            uint32 Next = Running.Successors[ Slot ];
+            if ( !Next )
+            {
+                Next = Cache->BlockAt[ RegFile.IP ];
+                if ( !Next )
+                {
+                    Prev = Current;
+                    PrevSlot = Slot;
+                    break;
+                }
+
+                Cache->Blocks[ Current - 1 ].Successors[ Slot ] = Next;
+            }
+
+            Current = Next;
+        }
+    }
+
+Done:
+    if constexpr ( Level != TraceLevel::Off )
+    {
+        printf( "Decode cache: %llu hits, %llu misses, %llu invalidations\n",
+                (unsigned long long)Cache->Decode.Hits, (unsigned long long)Cache->Decode.Misses, (unsigned long long)Cache->Decode.Invalidations );
+        printf( "Blocks: %llu translated, %llu fused pairs, %llu flushes\n",
+                (unsigned long long)Cache->Translations, (unsigned long long)Cache->FusedPairs, (unsigned long long)Cache->Flushes );
+        printf( "Counted loops: %llu fast-forwarded, %llu iterations skipped\n",
+                (unsigned long long)Cache->FastForwards, (unsigned long long)Cache->SkippedIterations );
+        printf( "Flag liveness: %llu dead flag writes skipped in translation\n", (unsigned long long)Cache->DeadFlagOps );
+
+        if ( Jit.Code )
+        {
+            printf( "JIT: %llu blocks compiled, %llu native block runs\n",
+                    (unsigned long long)Jit.CompiledBlocks, (unsigned long long)Jit.NativeRuns );
+        }
+    }
+
+    SyncJitContext( Ctx, Strg );
+
+    DestroyJitBuffer( Jit );
+    delete Cache;
+
+    return InstructionCount;
+}
+
+enum class EngineKind : uint8
+{
+    Interpreter,
+    Threaded,
+    Blocks,
+    Jit
+};
+
+template <TraceLevel Level>
+uint64 RunEngine( EngineKind Engine, Storage& Strg, const RunHooks& Hooks )
+{
+    uint64 InstructionCount = 0;
+    switch ( Engine )
+    {
+    case EngineKind::Threaded:
+        InstructionCount = SimulateThreaded8086<Level>( Strg, Hooks.Reference, Hooks.Repeat );
+        break;
+
+    case EngineKind::Blocks:
+        InstructionCount = SimulateBlocks8086<Level>( Strg, false, Hooks.Reference, Hooks.Repeat );
+        break;
+
+    case EngineKind::Jit:
+        InstructionCount = SimulateBlocks8086<Level>( Strg, true, Hooks.Reference, Hooks.Repeat );
+        break;
+
+    default:
+        InstructionCount = Simulate8086<Level>( Strg, Hooks );
+        break;
+    }
+
+    // The end of the run is checked whatever the interval
+    if ( Hooks.Reference && !Hooks.Reference->Diverged )
+    {
+        CheckAgainstReference( *Hooks.Reference, Strg, InstructionCount );
+    }
+
+    return InstructionCount;
+}
+
+bool LoadProgram( const char* FileName, Storage& Strg )
+{
+#if SIM_POSIX_IO
+    int InputFile = open( FileName, O_RDONLY );
+    if ( InputFile < 0 )
+    {
+        printf( "ERROR: cannot open %s!\n", FileName );
+        return false;
+    }
+
+    struct stat FileStat;
+    long FileSize = 0 == fstat( InputFile, &FileStat ) ? (long)FileStat.st_size : -1;
+#else
+    FILE* InputFile = fopen( FileName, "rb" );
+    if ( !InputFile )
+    {
+        printf( "ERROR: cannot open %s!\n", FileName );
+        return false;
+    }
+
+    fseek( InputFile, 0L, SEEK_END );
+    long FileSize = ftell( InputFile );
+    fseek( InputFile, 0L, SEEK_SET );
+#endif
+
+    if ( FileSize < 0 || FileSize >= UINT16_MAX )
+    {
+        printf( "ERROR: the program is too long!" );
+#if SIM_POSIX_IO
+        close( InputFile );
+#else
+        fclose( InputFile );
+#endif
+        return false;
+    }
+
+    const uint16 ProgramSize = (uint16)FileSize;
+
+    // Copy the program size into the first 2 bytes of memory
+    memcpy( &Strg.Memory[0], &ProgramSize, 2 );
+
+    // Copy the program itself into memory starting from byte 2
+#if SIM_POSIX_IO
+    bool Loaded = true;
+    if ( ProgramSize )
+    {
+        void* Mapping = mmap( nullptr, ProgramSize, PROT_READ, MAP_PRIVATE, InputFile, 0 );
+        if ( Mapping == MAP_FAILED )
+        {
+            printf( "ERROR: cannot map %s!\n", FileName );
+            Loaded = false;
+        }
+        else
+        {
+            memcpy( &Strg.Memory[2], Mapping, ProgramSize );
+            munmap( Mapping, ProgramSize );
+        }
+    }
+
+    close( InputFile );
+
+    return Loaded;
+#else
+    fread( &Strg.Memory[2], ProgramSize, 1, InputFile );
+    fclose( InputFile );
+
+    return true;
+#endif
+}
+
+enum class DumpFormat : uint8
+{
+    None,
+    Full,
+    Sparse,
+    Ranges
+};
+
+// Full writes the 64KB image. Sparse writes the same file but leaves zero 4KB blocks as holes.
+// Ranges writes only the nonzero runs, each as a uint32 address, a uint32 size and the bytes.
+bool WriteMemoryDump( const char* Path, const uint8* Memory, uint32 MemorySize, DumpFormat Format )
+{
+#if SIM_POSIX_IO
+    if ( Format == DumpFormat::Sparse )
+    {
+        int DumpFile = open( Path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+        if ( DumpFile < 0 )
+        {
+            printf( "ERROR: cannot write %s!\n", Path );
+            return false;
+        }
+
+        // Size the file up front so that the skipped blocks read back as zeroes
+        bool Written = 0 == ftruncate( DumpFile, MemorySize );
+
+        constexpr uint32 BlockSize = 4096;
+        for ( uint32 Block = 0; Written && Block < MemorySize; Block += BlockSize )
+        {
+            const uint8* Begin = Memory + Block;
+            if ( std::any_of( Begin, Begin + BlockSize, []( uint8 Byte ) { return Byte != 0; } ) )
+            {
+                Written = BlockSize == pwrite( DumpFile, Begin, BlockSize, Block );
+            }
+        }
+
+        Written = 0 == close( DumpFile ) && Written;
+        if ( !Written )
+        {
+            printf( "ERROR: cannot write %s!\n", Path );
+        }
+
+        return Written;
+    }
+#endif
+
+    FILE* DumpFile = fopen( Path, "wb" );
+    if ( !DumpFile )
+    {
+        printf( "ERROR: cannot write %s!\n", Path );
+        return false;
+    }
+
+    bool Written = true;
+    if ( Format == DumpFormat::Ranges )
+    {
+        // A gap shorter than a record header is cheaper to write than to split the range at
+        constexpr uint32 RecordHeaderSize = 2 * sizeof( uint32 );
+
+        uint32 Address = 0;
+        while ( Written && Address < MemorySize )
+        {
+            if ( !Memory[ Address ] )
+            {
+                Address++;
+                continue;
+            }
+
+            uint32 End = Address + 1;
+            uint32 Zeroes = 0;
+            for ( uint32 Next = End; Next < MemorySize && Zeroes <= RecordHeaderSize; Next++ )
+            {
+                if ( Memory[ Next ] )
+                {
+                    End = Next + 1;
+                    Zeroes = 0;
+                }
+                else
+                {
+                    Zeroes++;
+                }
+            }
+
+            uint32 Header[2] = { Address, End - Address };
+            Written = 1 == fwrite( Header, sizeof( Header ), 1, DumpFile ) && 1 == fwrite( Memory + Address, End - Address, 1, DumpFile );
+
+            Address = End;
+        }
+    }
+    else
+    {
+        Written = 1 == fwrite( Memory, MemorySize, 1, DumpFile );
+    }
+
+    Written = 0 == fclose( DumpFile ) && Written;
+    if ( !Written )
+    {
+        printf( "ERROR: cannot write %s!\n", Path );
+    }
+
+    return Written;
+}
+
+// Interprets the program without tracing until it is about to execute the instruction at
+// StopIP. Returns false if the program ends or fails first.
+bool RunToIP( Storage& Strg, uint16 StopIP, uint64& InstructionCount )
+{
+    const uint16 ProgramSize = *(uint16*)&Strg.Memory[0];
+    DecodeCache* Cache = new DecodeCache{};
+
+    bool Reached = false;
+    while ( Strg.RegFile.IP < ProgramSize )
+    {
+        if ( Strg.RegFile.IP == StopIP )
+        {
+            Reached = true;
+            break;
+        }
+
+        const Instruction& Instr = FetchInstruction( *Cache, Strg.Memory, 2 + Strg.RegFile.IP );
+        if ( Instr.Name == IName::UNKNOWN )
+        {
+            printf( "ERROR: Unknown instruction 0x%02x at IP %d!\n", Strg.Memory[ 2 + Strg.RegFile.IP ], Strg.RegFile.IP );
+            break;
+        }
+
+        ExecuteInstruction<TraceLevel::Off>( Instr, Strg, *Cache );
+        InstructionCount++;
+    }
+
+    delete Cache;
+
+    return Reached;
+}
+
+// Runs Task( Index ) for every index below TaskCount on ThreadCount workers. Each worker pops
+// from the front of its own deque and, once that is empty, steals from the back of the others.
+template <typename TaskFunction>
+void RunWorkStealing( size_t TaskCount, uint32 ThreadCount, TaskFunction Task )
+{
+    struct WorkQueue
+    {
+        std::mutex Lock;
+        std::deque<size_t> Tasks;
+    };
+
+    std::vector<WorkQueue> Queues( ThreadCount );
+    for ( size_t i = 0; i < TaskCount; i++ )
+    {
+        Queues[ i % ThreadCount ].Tasks.push_back( i );
+    }
+
+    auto Worker = [&]( uint32 Self )
+    {
+        for (;;)
+        {
+            size_t Index = SIZE_MAX;
+            for ( uint32 i = 0; i < ThreadCount && Index == SIZE_MAX; i++ )
+            {
+                WorkQueue& Queue = Queues[ ( Self + i ) % ThreadCount ];
+                std::lock_guard<std::mutex> Guard( Queue.Lock );
+
+                if ( !Queue.Tasks.empty() )
+                {
+                    if ( i == 0 )
+                    {
+                        Index = Queue.Tasks.front();
+                        Queue.Tasks.pop_front();
+                    }
+                    else
+                    {
+                        Index = Queue.Tasks.back();
+                        Queue.Tasks.pop_back();
+                    }
+                }
+            }
+
+            // Nothing spawns new tasks, so every queue being empty means the work is done
+            if ( Index == SIZE_MAX )
+            {
+                return;
+            }
+
+            Task( Index );
+        }
+    };
+
+    std::vector<std::thread> Threads;
+    for ( uint32 i = 1; i < ThreadCount; i++ )
+    {
+        Threads.emplace_back( Worker, i );
+    }
+
+    Worker( 0 );
+
+    for ( std::thread& Thread : Threads )
+    {
+        Thread.join();
+    }
+}
+
+enum class RunStatus : uint8
+{
+    Halted,          // IP ran past the end of the program
+    BudgetExhausted, // Stopped on an instruction boundary with work left
+    Fault,           // Unknown instruction at IP
+    TimedOut         // Set by the scheduler once a guest has used up its timeout
+};
+
+const char* GRunStatusNames[] = { "halted", "budget", "fault", "timeout" };
+
+// A machine that runs a slice at a time through Run8086. ProgramSize is read once at load,
+// like Simulate8086 does, so a guest writing over the size header still ends where it would.
+struct GuestMachine
+{
+    const char* Name;
+    Storage* Strg;
+    uint16 ProgramSize;
+    uint64 Instructions = 0;
+    uint64 Slices = 0;
+
+    // Until its first slice, a guest has all of its work left
+    RunStatus Status = RunStatus::BudgetExhausted;
+};
+
+// Drops every entry, clearing only the ones filled since the last reset
+void ResetDecodeCache( DecodeCache& Cache )
+{
+    if ( Cache.FilledOverflow )
+    {
+        memset( Cache.Valid, 0, sizeof( Cache.Valid ) );
+    }
+    else
+    {
+        for ( uint32 i = 0; i < Cache.FilledCount; i++ )
+        {
+            Cache.Valid[ Cache.Filled[i] ] = false;
+        }
+    }
+
+    Cache.FilledCount = 0;
+    Cache.FilledOverflow = false;
+}
+
+// Runs Guest for up to Budget instructions, or clocks with BudgetInClocks. A single cache can
+// serve any number of guests instead of each of them carrying its own: it is reset whenever it
+// last ran a different guest, and a guest that runs again keeps what it decoded, since its own
+// stores invalidate whatever they change.
+template <bool BudgetInClocks>
+RunStatus Run8086( GuestMachine& Guest, DecodeCache& Cache, uint64 Budget )
+{
+    constexpr TraceLevel Level = BudgetInClocks ? TraceLevel::Summary : TraceLevel::Off;
+
+    Storage& Strg = *Guest.Strg;
+    if ( Cache.Owner != &Guest )
+    {
+        ResetDecodeCache( Cache );
+        Cache.Owner = &Guest;
+    }
+
+    Guest.Slices++;
+
+    const uint64 Limit = ( BudgetInClocks ? Strg.Clocks.Total : Guest.Instructions ) + Budget;
+    while ( Strg.RegFile.IP < Guest.ProgramSize )
+    {
+        if ( ( BudgetInClocks ? Strg.Clocks.Total : Guest.Instructions ) >= Limit )
+        {
+            return RunStatus::BudgetExhausted;
+        }
+
+        const Instruction& Instr = FetchInstruction( Cache, Strg.Memory, 2 + Strg.RegFile.IP );
+        if ( Instr.Name == IName::UNKNOWN )
+        {
+            return RunStatus::Fault;
+        }
+
+        ExecuteInstruction<Level>( Instr, Strg, Cache );
+        Guest.Instructions++;
+    }
+
+    return RunStatus::Halted;
+}
+
+void PrintResultRecord( const char* Name, const RegisterFile& RegFile, uint64 MemoryHash )
+{
+    printf( "%s:", Name );
+    for ( uint32 Reg = 0; Reg < sizeof(GRegTableX) / sizeof(GRegTableX[0]); Reg++ )
+    {
+        printf( " %s=0x%04x", GRegTableX[ Reg ], RegFile.GPRs[ Reg ] );
+    }
+
+    printf( " FLAGS=0x%04x IP=%d MEM=%016llx\n", EvaluateFlags( RegFile ), RegFile.IP, (unsigned long long)MemoryHash );
+}
+
+// Final state of one program of a batch run
+struct BatchResult
+{
+    bool Loaded;
+    RunStatus Status;
+    RegisterFile RegFile;
+    uint64 MemoryHash;
+};
+
+// Binaries of a batch: every regular file of a directory, or the paths listed in a file
+bool CollectBatchPrograms( const char* Path, std::vector<std::string>& Programs )
+{
+    std::error_code Error;
+    if ( std::filesystem::is_directory( Path, Error ) )
+    {
+        for ( const auto& Entry : std::filesystem::directory_iterator( Path, Error ) )
+        {
+            if ( Entry.is_regular_file() )
+            {
+                Programs.push_back( Entry.path().string() );
+            }
+        }
+
+        std::sort( Programs.begin(), Programs.end() );
+        return !Error;
+    }
+
+    FILE* ListFile = fopen( Path, "r" );
+    if ( !ListFile )
+    {
+        return false;
+    }
+
+    char Line[ 4096 ];
+    while ( fgets( Line, sizeof( Line ), ListFile ) )
+    {
+        Line[ strcspn( Line, "\r\n" ) ] = 0;
+        if ( Line[0] )
+        {
+            Programs.push_back( Line );
+        }
+    }
+
+    fclose( ListFile );
+    return true;
+}
+
+// Runs every program in its own Storage through Run8086, for at most Timeout instructions
+// (0 for no limit), and prints one combined report in input order. Nothing is written to
+// mem_dump.bin, the memory hash stands in for it.
+int RunBatch( const char* Path, uint32 ThreadCount, uint64 Timeout )
+{
+    std::vector<std::string> Programs;
+    if ( !CollectBatchPrograms( Path, Programs ) )
+    {
+        printf( "ERROR: cannot read the batch %s!\n", Path );
+        return -1;
+    }
+
+    std::vector<BatchResult> Results( Programs.size() );
+
+    auto StartTime = std::chrono::steady_clock::now();
+
+    RunWorkStealing( Programs.size(), ThreadCount, [&]( size_t Index )
+    {
+        Storage* Strg = new Storage{};
+        BatchResult& Result = Results[ Index ];
+
+        Result.Loaded = LoadProgram( Programs[ Index ].c_str(), *Strg );
+        if ( Result.Loaded )
+        {
+            DecodeCache* Cache = new DecodeCache{};
+            GuestMachine Guest{ Programs[ Index ].c_str(), Strg, *(uint16*)&Strg->Memory[0] };
+
+            Result.Status = Run8086<false>( Guest, *Cache, Timeout ? Timeout : UINT64_MAX );
+            if ( Result.Status == RunStatus::BudgetExhausted )
+            {
+                Result.Status = RunStatus::TimedOut;
+            }
+
+            delete Cache;
+            Result.RegFile = Strg->RegFile;
+            Result.MemoryHash = HashStorage( *Strg );
+        }
+
+        DeleteStorage( Strg );
+    } );
+
+    double Seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - StartTime ).count();
+
+    uint32 Failed = 0;
+    uint32 StatusCounts[ 4 ] = {};
+    for ( size_t i = 0; i < Programs.size(); i++ )
+    {
+        const BatchResult& Result = Results[i];
+        if ( !Result.Loaded )
+        {
+            printf( "%s: not loaded\n", Programs[i].c_str() );
+            Failed++;
+            continue;
+        }
+
+        StatusCounts[ (uint8)Result.Status ]++;
+
+        std::string Name = Programs[i] + " (" + GRunStatusNames[ (uint8)Result.Status ] + ")";
+        PrintResultRecord( Name.c_str(), Result.RegFile, Result.MemoryHash );
+    }
+
+    printf( "Batch: %zu programs, %u not loaded, %u faulted, %u timed out, %u threads, %.3f ms (%.1f programs/s)\n",
+            Programs.size(), Failed, StatusCounts[ (uint8)RunStatus::Fault ], StatusCounts[ (uint8)RunStatus::TimedOut ],
+            ThreadCount, Seconds * 1000.0, Seconds > 0.0 ? Programs.size() / Seconds : 0.0 );
+
+    return Failed ? -1 : 0;
+}
+
+// Round-robins Copies instances of every program of a batch over ThreadCount host threads,
+// giving each guest Slice instructions (or clocks) per turn until it halts, faults or has run
+// for Timeout. Guests are split statically between threads and stay on theirs.
+int RunSchedule( const char* Path, uint32 Copies, uint32 ThreadCount, uint64 Slice, uint64 Timeout, bool InClocks )
+{
+    std::vector<std::string> Programs;
+    if ( !CollectBatchPrograms( Path, Programs ) )
+    {
+        printf( "ERROR: cannot read the batch %s!\n", Path );
+        return -1;
+    }
+
+    std::vector<GuestMachine> Guests;
+    Guests.reserve( Programs.size() * Copies );
+
+    Storage* Image = new Storage{};
+    uint32 Failed = 0;
+    for ( const std::string& Program : Programs )
+    {
+        memset( Image, 0, sizeof( Storage ) );
+        if ( !LoadProgram( Program.c_str(), *Image ) )
+        {
+            printf( "%s: not loaded\n", Program.c_str() );
+            Failed++;
+            continue;
+        }
+
+        for ( uint32 i = 0; i < Copies; i++ )
+        {
+            Guests.push_back( { Program.c_str(), TakeSnapshot( *Image ), *(uint16*)&Image->Memory[0] } );
+        }
+    }
+
+    delete Image;
+
+    ThreadCount = (uint32)std::max<size_t>( 1, std::min<size_t>( ThreadCount, Guests.size() ) );
+
+    auto StartTime = std::chrono::steady_clock::now();
+
+    auto Worker = [&]( uint32 Self )
+    {
+        DecodeCache* Cache = new DecodeCache{};
+
+        std::vector<GuestMachine*> Active;
+        for ( size_t i = Self; i < Guests.size(); i += ThreadCount )
+        {
+            Active.push_back( &Guests[i] );
+        }
+
+        while ( !Active.empty() )
+        {
+            for ( size_t i = 0; i < Active.size(); )
+            {
+                GuestMachine& Guest = *Active[i];
+
+                uint64 Used = InClocks ? Guest.Strg->Clocks.Total : Guest.Instructions;
+                uint64 Budget = Timeout ? std::min( Slice, Timeout - std::min( Used, Timeout ) ) : Slice;
+
+                Guest.Status = InClocks ? Run8086<true>( Guest, *Cache, Budget ) : Run8086<false>( Guest, *Cache, Budget );
+
+                Used = InClocks ? Guest.Strg->Clocks.Total : Guest.Instructions;
+                if ( Guest.Status == RunStatus::BudgetExhausted && Timeout && Used >= Timeout )
+                {
+                    Guest.Status = RunStatus::TimedOut;
+                }
+
+                if ( Guest.Status == RunStatus::BudgetExhausted )
+                {
+                    i++;
+                }
+                else
+                {
+                    Active[i] = Active.back();
+                    Active.pop_back();
+                }
+            }
+        }
+
+        delete Cache;
+    };
+
+    std::vector<std::thread> Threads;
+    for ( uint32 i = 1; i < ThreadCount; i++ )
+    {
+        Threads.emplace_back( Worker, i );
+    }
+
+    Worker( 0 );
+
+    for ( std::thread& Thread : Threads )
+    {
+        Thread.join();
+    }
+
+    double Seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - StartTime ).count();
+
+    // Copies run the same program, so only the first of each is reported
+    uint64 StatusCounts[ 4 ] = {};
+    uint64 Instructions = 0;
+    uint64 Slices = 0;
+    for ( size_t i = 0; i < Guests.size(); i++ )
+    {
+        GuestMachine& Guest = Guests[i];
+        StatusCounts[ (uint8)Guest.Status ]++;
+        Instructions += Guest.Instructions;
+        Slices += Guest.Slices;
+
+        if ( i % Copies == 0 )
+        {
+            std::string Name = std::string( Guest.Name ) + " (" + GRunStatusNames[ (uint8)Guest.Status ] + ")";
+            PrintResultRecord( Name.c_str(), Guest.Strg->RegFile, HashStorage( *Guest.Strg ) );
+        }
+
+        DeleteStorage( Guest.Strg );
+    }
+
+    printf( "Schedule: %zu guests, %u threads, %llu halted, %llu faulted, %llu timed out, %llu slices\n",
+            Guests.size(), ThreadCount, (unsigned long long)StatusCounts[ (uint8)RunStatus::Halted ],
+            (unsigned long long)StatusCounts[ (uint8)RunStatus::Fault ], (unsigned long long)StatusCounts[ (uint8)RunStatus::TimedOut ], (unsigned long long)Slices );
+    printf( "Executed instructions: %llu in %.3f ms (%.2f MIPS)\n",
+            (unsigned long long)Instructions, Seconds * 1000.0, Seconds > 0.0 ? Instructions / Seconds / 1e6 : 0.0 );
+
+    return Failed ? -1 : 0;
+}
+
+// A slice of the program decoded on its own. Offsets starts as a linear sweep from Start and
+// is stitched onto the previous chunk's last instruction before the chunk is formatted.
+struct DisasmChunk
+{
+    uint32 Start;
+    uint32 End;
+    std::vector<uint32> Offsets;
+    std::vector<Instruction> Instrs;
+    std::string Text;
+};
+
+constexpr uint32 DisasmChunkSize = 4096;
+
+void AppendFormat( std::string& Out, const char* Format, ... )
+{
+    char Line[ 128 ];
+
+    va_list Args;
+    va_start( Args, Format );
+    int Length = vsnprintf( Line, sizeof( Line ), Format, Args );
+    va_end( Args );
+
+    Out.append( Line, std::min<size_t>( Length, sizeof( Line ) - 1 ) );
+}
+
+void AppendEffectiveAddress( std::string& Out, const Instruction& Instr )
+{
+    if ( Instr.RegMem & EaDirect )
+    {
+        AppendFormat( Out, "[%d]", Instr.Displacement );
+    }
+    else if ( Instr.RegMem & EaDisplacement )
+    {
+        AppendFormat( Out, "[%s + %d]", GRegMemTable[ Instr.RegMem & 0b111 ], Instr.Displacement );
+    }
+    else
+    {
+        AppendFormat( Out, "[%s]", GRegMemTable[ Instr.RegMem & 0b111 ] );
+    }
+}
+
+// One NASM line for the instruction at Offset. Operands read the same as PrintInstruction;
+// immediates to memory get a size, jumps to decoded instructions get labels, and anything
+// the decoder does not know or that runs past the end of the program becomes db.
+void AppendNasmInstruction( std::string& Out, const Instruction& Instr, uint32 Offset, const uint8* Code, uint32 ProgramSize, const std::vector<uint8>& IsLabel )
+{
+    if ( Instr.Name == IName::UNKNOWN || Offset + Instr.ByteSize > ProgramSize )
+    {
+        uint32 End = std::min<uint32>( Offset + std::max<uint32>( Instr.ByteSize, 1 ), ProgramSize );
+        Out += "db ";
+        for ( uint32 i = Offset; i < End; i++ )
+        {
+            AppendFormat( Out, i == Offset ? "0x%02x" : ", 0x%02x", Code[i] );
+        }
+
+        Out += "\n";
+        return;
+    }
+
+    Out += InstrNames[ (uint8)Instr.Name ];
+
+    switch ( Instr.Form )
+    {
+    case OperandForm::RegReg:
+        AppendFormat( Out, " %s, %s", GetRegisterName( Instr.Reg, Instr.Wide ), GetRegisterName( Instr.RegMem, Instr.Wide ) );
+        break;
+
+    case OperandForm::RegImm:
+        AppendFormat( Out, " %s, %d", GetRegisterName( Instr.Reg, Instr.Wide ), GetPrintedImmediate( Instr ) );
+        break;
+
+    case OperandForm::RegMem:
+        AppendFormat( Out, " %s, ", GetRegisterName( Instr.Reg, Instr.Wide ) );
+        AppendEffectiveAddress( Out, Instr );
+        break;
+
+    case OperandForm::MemReg:
+        Out += " ";
+        AppendEffectiveAddress( Out, Instr );
+        AppendFormat( Out, ", %s", GetRegisterName( Instr.Reg, Instr.Wide ) );
+        break;
+
+    case OperandForm::MemImm:
+        Out += Instr.Wide ? " WORD " : " BYTE ";
+        AppendEffectiveAddress( Out, Instr );
+        AppendFormat( Out, ", %d", GetPrintedImmediate( Instr ) );
+        break;
+
+    case OperandForm::Rel8:
+        {
+            int32 Relative = Instr.ByteSize + static_cast<int8>( Instr.Displacement );
+            int32 Target = (int32)Offset + Relative;
+            if ( Target >= 0 && Target < (int32)ProgramSize && IsLabel[ Target ] )
+            {
+                AppendFormat( Out, " label_%d", Target );
+            }
+            else
+            {
+                AppendFormat( Out, " $%+d", Relative );
+            }
+            break;
+        }
+
+    case OperandForm::SegReg:
+        AppendFormat( Out, " %s, %s", GSegTable[ Instr.Reg ], GRegTableX[ Instr.RegMem ] );
+        break;
+
+    case OperandForm::SegMem:
+        AppendFormat( Out, " %s, ", GSegTable[ Instr.Reg ] );
+        AppendEffectiveAddress( Out, Instr );
+        break;
+
+    case OperandForm::RegSeg:
+        AppendFormat( Out, " %s, %s", GRegTableX[ Instr.RegMem ], GSegTable[ Instr.Reg ] );
+        break;
+
+    case OperandForm::MemSeg:
+        Out += " ";
+        AppendEffectiveAddress( Out, Instr );
+        AppendFormat( Out, ", %s", GSegTable[ Instr.Reg ] );
+        break;
+
+    default:
+        break;
+    }
+
+    Out += "\n";
+}
+
+// Linear-sweep disassembly of the whole program as NASM source, decoded and formatted in
+// DisasmChunkSize slices on ThreadCount threads
+int DisassembleProgram( const char* FileName, uint32 ThreadCount )
+{
+    Storage* Strg = new Storage{};
+    if ( !LoadProgram( FileName, *Strg ) )
+    {
+        delete Strg;
+        return -1;
+    }
+
+    // Padded so that decoding the last bytes never reads past the program
+    const uint32 ProgramSize = *(uint16*)&Strg->Memory[0];
+    std::vector<uint8> Code( ProgramSize + MaxInstructionSize, 0 );
+    memcpy( Code.data(), &Strg->Memory[2], ProgramSize );
+    delete Strg;
+
+    std::vector<DisasmChunk> Chunks( ( ProgramSize + DisasmChunkSize - 1 ) / DisasmChunkSize );
+    for ( size_t i = 0; i < Chunks.size(); i++ )
+    {
+        Chunks[i].Start = (uint32)i * DisasmChunkSize;
+        Chunks[i].End = std::min<uint32>( Chunks[i].Start + DisasmChunkSize, ProgramSize );
+    }
+
+    RunWorkStealing( Chunks.size(), ThreadCount, [&]( size_t Index )
+    {
+        DisasmChunk& Chunk = Chunks[ Index ];
+        for ( uint32 Offset = Chunk.Start; Offset < Chunk.End; )
+        {
+            Instruction Instr = DecodeInstruction( &Code[ Offset ] );
+            Chunk.Offsets.push_back( Offset );
+            Chunk.Instrs.push_back( Instr );
+            Offset += Instr.ByteSize;
+        }
+    } );
+
+    // A chunk's sweep may have started inside an instruction of the previous chunk. Decode
+    // again from where the previous chunk really ended until the two sweeps meet, which on
+    // 8086 code takes a few instructions, and drop what came before.
+    std::vector<uint8> IsBoundary( ProgramSize, 0 );
+    uint32 Next = 0;
+    for ( DisasmChunk& Chunk : Chunks )
+    {
+        size_t First = std::lower_bound( Chunk.Offsets.begin(), Chunk.Offsets.end(), Next ) - Chunk.Offsets.begin();
+
+        std::vector<uint32> Offsets;
+        std::vector<Instruction> Instrs;
+        while ( Next < Chunk.End && ( First == Chunk.Offsets.size() || Chunk.Offsets[ First ] != Next ) )
+        {
+            Instruction Instr = DecodeInstruction( &Code[ Next ] );
+            Offsets.push_back( Next );
+            Instrs.push_back( Instr );
+            Next += Instr.ByteSize;
+
+            while ( First < Chunk.Offsets.size() && Chunk.Offsets[ First ] < Next )
+            {
+                First++;
+            }
+        }
+
+        Offsets.insert( Offsets.end(), Chunk.Offsets.begin() + First, Chunk.Offsets.end() );
+        Instrs.insert( Instrs.end(), Chunk.Instrs.begin() + First, Chunk.Instrs.end() );
+        Chunk.Offsets.swap( Offsets );
+        Chunk.Instrs.swap( Instrs );
+
+        for ( uint32 Offset : Chunk.Offsets )
+        {
+            IsBoundary[ Offset ] = 1;
+        }
+
+        if ( !Chunk.Offsets.empty() )
+        {
+            Next = Chunk.Offsets.back() + Chunk.Instrs.back().ByteSize;
+        }
+    }
+
+    std::vector<uint8> IsLabel( ProgramSize, 0 );
+    uint32 InstructionCount = 0;
+    uint32 LabelCount = 0;
+    for ( const DisasmChunk& Chunk : Chunks )
+    {
+        InstructionCount += (uint32)Chunk.Instrs.size();
+        for ( size_t i = 0; i < Chunk.Instrs.size(); i++ )
+        {
+            const Instruction& Instr = Chunk.Instrs[i];
+            if ( Instr.Form != OperandForm::Rel8 )
+            {
+                continue;
+            }
+
+            int32 Target = (int32)Chunk.Offsets[i] + Instr.ByteSize + static_cast<int8>( Instr.Displacement );
+            if ( Target >= 0 && Target < (int32)ProgramSize && IsBoundary[ Target ] && !IsLabel[ Target ] )
+            {
+                IsLabel[ Target ] = 1;
+                LabelCount++;
+            }
+        }
+    }
+
+    RunWorkStealing( Chunks.size(), ThreadCount, [&]( size_t Index )
+    {
+        DisasmChunk& Chunk = Chunks[ Index ];
+        Chunk.Text.reserve( Chunk.Instrs.size() * 24 );
+
+        for ( size_t i = 0; i < Chunk.Instrs.size(); i++ )
+        {
+            if ( IsLabel[ Chunk.Offsets[i] ] )
+            {
+                AppendFormat( Chunk.Text, "label_%u:\n", Chunk.Offsets[i] );
+            }
+
+            AppendNasmInstruction( Chunk.Text, Chunk.Instrs[i], Chunk.Offsets[i], Code.data(), ProgramSize, IsLabel );
+        }
+    } );
+
+    std::string Header;
+    AppendFormat( Header, "; %s\nbits 16\n\n", FileName );
+    fwrite( Header.data(), 1, Header.size(), stdout );
+
+    for ( const DisasmChunk& Chunk : Chunks )
+    {
+        fwrite( Chunk.Text.data(), 1, Chunk.Text.size(), stdout );
+    }
+
+    printf( "\n; %u instructions, %u labels, %zu chunks\n", InstructionCount, LabelCount, Chunks.size() );
+
+    return 0;
+}
+
+void AppendFlagNames( std::string& Out, uint16 Mask, bool Quoted )
+{
+    const char* Separator = "";
+    for ( const FlagInfo& Flag : GFlagTable )
+    {
+        if ( Mask & Flag.Mask )
+        {
+            AppendFormat( Out, Quoted ? "%s\"%s\"" : "%s%s", Separator, Flag.Name );
+            Separator = Quoted ? ", " : " ";
+        }
+    }
+
+    if ( !Quoted && !*Separator )
+    {
+        Out += "-";
+    }
+}
+
+void AppendEscaped( std::string& Out, const char* Text )
+{
+    for ( ; *Text; Text++ )
+    {
+        if ( *Text == '"' || *Text == '\\' )
+        {
+            Out += '\\';
+        }
+
+        Out += *Text;
+    }
+}
+
+// Writes the recovered control flow graph as Graphviz DOT, or as JSON when Path ends in .json.
+// Every instruction carries the flags live after it, so dead flag writes read as "live: -".
+int ExportControlFlow( const char* FileName, const char* Path )
+{
+    Storage* Strg = new Storage{};
+    if ( !LoadProgram( FileName, *Strg ) )
+    {
+        delete Strg;
+        return -1;
+    }
+
+    const uint32 ProgramSize = *(uint16*)&Strg->Memory[0];
+    ControlFlowGraph Graph = RecoverControlFlow( Strg->Memory, (uint16)ProgramSize );
+
+    std::vector<uint8> Code( ProgramSize + MaxInstructionSize, 0 );
+    memcpy( Code.data(), &Strg->Memory[2], ProgramSize );
+    delete Strg;
+
+    std::vector<uint8> IsLabel( ProgramSize, 0 );
+    for ( const CfgBlock& Node : Graph.Blocks )
+    {
+        IsLabel[ Node.Start ] = 1;
+    }
+
+    size_t PathLength = strlen( Path );
+    bool Json = PathLength >= 5 && 0 == strcmp( Path + PathLength - 5, ".json" );
+
+    std::string Out;
+    if ( Json )
+    {
+        Out += "{\n    \"program\": \"";
+        AppendEscaped( Out, FileName );
+        AppendFormat( Out, "\",\n    \"size\": %u,\n    \"blocks\": [", ProgramSize );
+    }
+    else
+    {
+        Out += "digraph \"";
+        AppendEscaped( Out, FileName );
+        Out += "\"\n{\n    node [shape=box, fontname=\"monospace\"];\n    exit [shape=oval];\n";
+    }
+
+    static const char* EdgeNames[2] = { "fallthrough", "taken" };
+
+    for ( size_t i = 0; i < Graph.Blocks.size(); i++ )
+    {
+        const CfgBlock& Node = Graph.Blocks[i];
+        if ( Json )
+        {
+            AppendFormat( Out, "%s\n        {\n            \"id\": %zu,\n            \"start\": %u,\n            \"end\": %u,\n            \"live_in\": [",
+                          i ? "," : "", i, Node.Start, Node.End );
+            AppendFlagNames( Out, Node.LiveIn, true );
+            Out += "],\n            \"live_out\": [";
+            AppendFlagNames( Out, Node.LiveOut, true );
+            Out += "],\n            \"successors\": [";
+
+            const char* Separator = "";
+            for ( uint8 Slot = 0; Slot < 2; Slot++ )
+            {
+                if ( Node.Successors[ Slot ] >= 0 )
+                {
+                    AppendFormat( Out, "%s{ \"block\": %d, \"edge\": \"%s\" }", Separator, Node.Successors[ Slot ], EdgeNames[ Slot ] );
+                    Separator = ", ";
+                }
+            }
+
+            AppendFormat( Out, "],\n            \"exits\": %s,\n            \"instructions\": [", Node.Exits ? "true" : "false" );
+        }
+        else
+        {
+            AppendFormat( Out, "    label_%u [label=\"label_%u:  live in: ", Node.Start, Node.Start );
+            AppendFlagNames( Out, Node.LiveIn, false );
+            Out += "\\l";
+        }
+
+        for ( uint32 j = 0; j < Node.InstructionCount; j++ )
+        {
+            uint16 IP = Graph.Instructions[ Node.FirstInstruction + j ];
+
+            std::string Text;
+            AppendNasmInstruction( Text, DecodeInstruction( &Code[ IP ] ), IP, Code.data(), ProgramSize, IsLabel );
+            Text.pop_back();
+
+            if ( Json )
+            {
+                AppendFormat( Out, "%s\n                { \"ip\": %u, \"text\": \"%s\", \"live_out\": [", j ? "," : "", IP, Text.c_str() );
+                AppendFlagNames( Out, Graph.LiveOut[ IP ], true );
+                Out += "] }";
+            }
+            else
+            {
+                AppendFormat( Out, "%5u: %-24s ; live: ", IP, Text.c_str() );
+                AppendFlagNames( Out, Graph.LiveOut[ IP ], false );
+                Out += "\\l";
+            }
+        }
+
+        if ( Json )
+        {
+            Out += Node.InstructionCount ? "\n            ]\n        }" : "]\n        }";
+            continue;
+        }
+
+        Out += "\"];\n";
+        for ( uint8 Slot = 0; Slot < 2; Slot++ )
+        {
+            if ( Node.Successors[ Slot ] >= 0 )
+            {
+                AppendFormat( Out, "    label_%u -> label_%u [label=\"%s\"];\n", Node.Start, Graph.Blocks[ Node.Successors[ Slot ] ].Start, EdgeNames[ Slot ] );
+            }
+        }
+
+        if ( Node.Exits )
+        {
+            AppendFormat( Out, "    label_%u -> exit;\n", Node.Start );
+        }
+    }
+
+    Out += Json ? "\n    ]\n}\n" : "}\n";
+
+    FILE* OutputFile = fopen( Path, "wb" );
+    if ( !OutputFile )
+    {
+        printf( "ERROR: cannot write %s!\n", Path );
+        return -1;
+    }
+
+    bool Written = Out.size() == fwrite( Out.data(), 1, Out.size(), OutputFile );
+    Written = 0 == fclose( OutputFile ) && Written;
+    if ( !Written )
+    {
+        printf( "ERROR: cannot write %s!\n", Path );
+        return -1;
+    }
+
+    printf( "Control flow: %zu blocks, %u edges, %zu instructions, %u dead flag writes\n",
+            Graph.Blocks.size(), Graph.Edges, Graph.Instructions.size(), Graph.DeadFlagWrites );
+
+    return 0;
+}
+
+// Throughput of one benchmark over all of its samples, in millions of Unit per second
+struct BenchResult
+{
+    std::string Name;
+    const char* Unit;
+    double Median;
+    double P10;
+    double P90;
+};
+
+// A benchmark's median and 10th percentile from a saved run, keyed by "<name> <unit>"
+struct BenchBaseline
+{
+    std::string Key;
+    double Median;
+    double P10;
+};
+
+constexpr double BenchSampleSeconds = 0.02;
+
+double Percentile( std::vector<double> Samples, double Fraction )
+{
+    std::sort( Samples.begin(), Samples.end() );
+    return Samples[ (size_t)( Fraction * ( Samples.size() - 1 ) + 0.5 ) ];
+}
+
+// Runs Iteration, which returns the units of work it did, enough times per sample to fill
+// BenchSampleSeconds, and returns each sample's units per second
+template <typename IterationFunction>
+std::vector<double> SampleThroughput( uint32 SampleCount, IterationFunction Iteration )
+{
+    auto StartTime = std::chrono::steady_clock::now();
+    Iteration();
+    double Once = std::chrono::duration<double>( std::chrono::steady_clock::now() - StartTime ).count();
+
+    uint64 Repeats = Once > 0.0 ? std::max<uint64>( 1, (uint64)( BenchSampleSeconds / Once ) ) : 1000;
+
+    std::vector<double> Samples;
+    for ( uint32 Sample = 0; Sample < SampleCount; Sample++ )
+    {
+        uint64 Units = 0;
+        StartTime = std::chrono::steady_clock::now();
+        for ( uint64 i = 0; i < Repeats; i++ )
+        {
+            Units += Iteration();
+        }
+
+        double Seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - StartTime ).count();
+        Samples.push_back( Seconds > 0.0 ? Units / Seconds : 0.0 );
+    }
+
+    return Samples;
+}
+
+// Guest MIPS of Engine over Image, from the runs RepeatRuns times after the first, with as
+// many runs per sample as fill BenchSampleSeconds of wall time, restores included. A program
+// that changes its own code can not be restarted that way, and is instead timed over whole
+// engine calls.
+std::vector<double> SampleSimThroughput( uint32 SampleCount, EngineKind Engine, Storage& Strg, const Storage& Image, uint64 InstructionCount )
+{
+    RepeatRuns Repeat{ &Image, 0, 0, 0.0, {} };
+    RunHooks Hooks{};
+    Hooks.Repeat = &Repeat;
+
+    auto Measure = [&]( uint32 Runs )
+    {
+        Repeat.Remaining = Runs;
+        Repeat.Timed = 0;
+        Repeat.Seconds = 0.0;
+        Repeat.Start = {};
+
+        RestoreSnapshot( Strg, Image );
+        RunEngine<TraceLevel::Off>( Engine, Strg, Hooks );
+    };
+
+    auto StartTime = std::chrono::steady_clock::now();
+    Measure( 16 );
+    double Wall = std::chrono::duration<double>( std::chrono::steady_clock::now() - StartTime ).count();
+
+    if ( !Repeat.Timed )
+    {
+        return SampleThroughput( SampleCount, [&]()
+        {
+            RestoreSnapshot( Strg, Image );
+            RunEngine<TraceLevel::Off>( Engine, Strg, {} );
+            return InstructionCount;
+        } );
+    }
+
+    double Once = Wall / ( Repeat.Timed + 1 );
+    uint32 Runs = Once > 0.0 ? (uint32)std::clamp( BenchSampleSeconds / Once, 1.0, 1e8 ) : 100000;
+
+    std::vector<double> Samples;
+    for ( uint32 Sample = 0; Sample < SampleCount; Sample++ )
+    {
+        Measure( Runs );
+        Samples.push_back( Repeat.Seconds > 0.0 ? (double)InstructionCount * Repeat.Timed / Repeat.Seconds : 0.0 );
+    }
+
+    return Samples;
+}
+
+void AddBenchResult( std::vector<BenchResult>& Results, std::string Name, const char* Unit, const std::vector<double>& Samples, double Scale )
+{
+    Results.push_back( { std::move( Name ), Unit, Percentile( Samples, 0.5 ) * Scale / 1e6, Percentile( Samples, 0.1 ) * Scale / 1e6,
+                         Percentile( Samples, 0.9 ) * Scale / 1e6 } );
+}
+
+// One benchmark, kept as a way to take more samples of it. Every unit is read from the same
+// samples, scaled by its factor.
+struct BenchCase
+{
+    std::string Name;
+    std::vector<std::pair<const char*, double>> Units;
+    std::function<std::vector<double>( uint32 )> Sample;
+    std::vector<double> Samples;
+};
+
+// Samples taken of one benchmark before moving on to the next, and how many more times one
+// that looks slower than its baseline is measured
+constexpr uint32 BenchRoundSamples = 5;
+constexpr uint32 BenchRetries = 3;
+
+// A median more than Threshold below its baseline is a regression, with the threshold widened
+// by how far the slower samples fall below the median in this run or in the baseline's,
+// whichever was noisier, so noise alone can not fail a run
+bool IsBenchRegression( double Median, double P10, const BenchBaseline& Baseline, double Threshold )
+{
+    double Spread = std::max( Median > 0.0 ? ( Median - P10 ) / Median : 0.0, ( Baseline.Median - Baseline.P10 ) / Baseline.Median );
+    return ( Median - Baseline.Median ) / Baseline.Median < -( Threshold + Spread );
+}
+
+bool IsBenchCaseSlower( const BenchCase& Case, const std::vector<BenchBaseline>& Baseline, double Threshold )
+{
+    double Median = Percentile( Case.Samples, 0.5 );
+    double P10 = Percentile( Case.Samples, 0.1 );
+    for ( const auto& [ Unit, Scale ] : Case.Units )
+    {
+        std::string Key = Case.Name + " " + Unit;
+        auto Found = std::find_if( Baseline.begin(), Baseline.end(), [&Key]( const BenchBaseline& Entry ) { return Entry.Key == Key; } );
+        if ( Found != Baseline.end() && Found->Median > 0.0 && IsBenchRegression( Median * Scale / 1e6, P10 * Scale / 1e6, *Found, Threshold ) )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Synthetic decoder input of one instruction mix: register moves, immediates, memory
+// operands, or all of them with jumps
+enum class BenchStream : uint8
+{
+    RegReg,
+    Immediate,
+    Memory,
+    Mixed
+};
+
+const char* GBenchStreamNames[] = { "regreg", "immediate", "memory", "mixed" };
+
+std::vector<uint8> BuildBenchStream( BenchStream Kind, uint32 Size )
+{
+    uint32 Seed = 0x9e3779b9u + (uint32)Kind;
+    auto Random = [&Seed]()
+    {
+        Seed = Seed * 1664525u + 1013904223u;
+        return (uint8)( Seed >> 24 );
+    };
+
+    std::vector<uint8> Code;
+    while ( Code.size() + MaxInstructionSize <= Size )
+    {
+        uint8 Pick = Kind == BenchStream::Mixed ? Random() % 4 : (uint8)Kind;
+        switch ( Pick )
+        {
+        case 0:
+            Code.insert( Code.end(), { uint8( 0x88 | ( Random() & 0b11 ) ), uint8( 0xC0 | ( Random() & 0b111111 ) ) } );
+            break;
+
+        case 1:
+            if ( Random() & 1 )
+            {
+                Code.insert( Code.end(), { uint8( 0xB8 | ( Random() & 0b111 ) ), Random(), Random() } );
+            }
+            else
+            {
+                Code.insert( Code.end(), { 0x81, uint8( 0xC0 | ( Random() & 0b111 ) ), Random(), Random() } );
+            }
+            break;
+
+        case 2:
+            {
+                uint8 ModRM = Random() & 0b10111111;
+                Code.insert( Code.end(), { uint8( 0x88 | ( Random() & 0b11 ) ), ModRM } );
+
+                uint8 Mod = ModRM >> 6;
+                uint32 DisplSize = Mod == 0b01 ? 1 : Mod == 0b10 || ( ModRM & 0b11000111 ) == 0b110 ? 2 : 0;
+                for ( uint32 i = 0; i < DisplSize; i++ )
+                {
+                    Code.push_back( Random() );
+                }
+                break;
+            }
+
+        default:
+            Code.insert( Code.end(), { uint8( 0x70 | ( Random() & 0b1111 ) ), Random() } );
+            break;
+        }
+    }
+
+    return Code;
+}
+
+// mov cx, 20000; then add ax, bx; mov [bp + 2], ax; sub dx, ax; sub cx, 1; jnz back
+const uint8 GBenchLoopProgram[] = { 0xB9, 0x20, 0x4E, 0x01, 0xD8, 0x89, 0x46, 0x02, 0x29, 0xC2, 0x83, 0xE9, 0x01, 0x75, 0xF4 };
+
+uint32 SweepDecode( const uint8* Code, uint32 Size, uint64& Checksum )
+{
+    uint32 Count = 0;
+    for ( uint32 Offset = 0; Offset < Size; Count++ )
+    {
+        Instruction Instr = DecodeInstruction( Code + Offset );
+        Checksum += (uint8)Instr.Name + Instr.Immediate;
+        Offset += Instr.ByteSize;
+    }
+
+    return Count;
+}
+
+// Only programs whose every instruction runs without an error are simulated
+bool IsBenchSimulatable( const uint8* Code, uint32 Size )
+{
+    for ( uint32 Offset = 0; Offset < Size; )
+    {
+        Instruction Instr = DecodeInstruction( Code + Offset );
+        if ( Instr.Name == IName::UNKNOWN || ( IsJump( Instr.Name ) && !IsJumpImplemented( Instr.Name ) ) )
+        {
+            return false;
+        }
+
+        Offset += Instr.ByteSize;
+    }
+
+    return true;
+}
+
+// Each line is "<name> <unit> <median> <p10>". Names may contain spaces, so the unit and the
+// values are taken from the last three fields and the key is everything before the median.
+bool LoadBenchBaseline( const char* FileName, std::vector<BenchBaseline>& Baseline )
+{
+    FILE* InputFile = fopen( FileName, "r" );
+    if ( !InputFile )
+    {
+        return false;
+    }
+
+    bool Parsed = true;
+    char Line[ 2048 ];
+    while ( Parsed && fgets( Line, sizeof( Line ), InputFile ) )
+    {
+        std::string Text( Line );
+        while ( !Text.empty() && ( Text.back() == '\n' || Text.back() == '\r' || Text.back() == ' ' ) )
+        {
+            Text.pop_back();
+        }
+
+        if ( Text.empty() )
+        {
+            continue;
+        }
+
+        size_t P10Start = Text.rfind( ' ' );
+        size_t MedianStart = P10Start == std::string::npos || P10Start == 0 ? std::string::npos : Text.rfind( ' ', P10Start - 1 );
+        size_t UnitStart = MedianStart == std::string::npos || MedianStart == 0 ? std::string::npos : Text.rfind( ' ', MedianStart - 1 );
+        Parsed = UnitStart != std::string::npos && UnitStart != 0;
+        if ( Parsed )
+        {
+            char* MedianEnd = nullptr;
+            char* P10End = nullptr;
+            double Median = strtod( Text.c_str() + MedianStart + 1, &MedianEnd );
+            double P10 = strtod( Text.c_str() + P10Start + 1, &P10End );
+            Parsed = MedianEnd == Text.c_str() + P10Start && *P10End == 0;
+            if ( Parsed )
+            {
+                Baseline.push_back( { Text.substr( 0, MedianStart ), Median, P10 } );
+            }
+        }
+    }
+
+    fclose( InputFile );
+    return Parsed;
+}
+
+// Decode throughput over synthetic streams and the programs in Path, then simulated MIPS of
+// every engine with tracing off. Results are compared against BaselinePath when given, and
+// a median more than Threshold, plus the spread of its samples, below its baseline fails the
+// run.
+int RunBenchmarks( const char* Path, uint32 SampleCount, const char* BaselinePath, const char* SavePath, double Threshold )
+{
+    std::vector<std::string> Programs;
+    if ( !CollectBatchPrograms( Path, Programs ) )
+    {
+        printf( "ERROR: cannot read the benchmark programs %s!\n", Path );
+        return -1;
+    }
+
+    std::vector<BenchBaseline> Baseline;
+    if ( BaselinePath && !LoadBenchBaseline( BaselinePath, Baseline ) )
+    {
+        printf( "ERROR: cannot read the baseline %s!\n", BaselinePath );
+        return -1;
+    }
+
+    // Every input as decoder bytes, padded so that a sweep never reads past the end
+    std::vector<std::pair<std::string, std::vector<uint8>>> Inputs;
+    for ( uint8 Kind = 0; Kind <= (uint8)BenchStream::Mixed; Kind++ )
+    {
+        Inputs.emplace_back( std::string( "synthetic/" ) + GBenchStreamNames[ Kind ], BuildBenchStream( (BenchStream)Kind, 60000 ) );
+    }
+
+    Inputs.emplace_back( "synthetic/loop", std::vector<uint8>( std::begin( GBenchLoopProgram ), std::end( GBenchLoopProgram ) ) );
+
+    for ( const std::string& Program : Programs )
+    {
+        Storage* Strg = new Storage{};
+        if ( LoadProgram( Program.c_str(), *Strg ) )
+        {
+            // Keyed on the file name alone, so a baseline holds wherever the programs are read from
+            size_t Slash = Program.find_last_of( '/' );
+            std::string Name = Slash == std::string::npos ? Program : Program.substr( Slash + 1 );
+
+            uint16 ProgramSize = *(uint16*)&Strg->Memory[0];
+            Inputs.emplace_back( Name, std::vector<uint8>( Strg->Memory + 2, Strg->Memory + 2 + ProgramSize ) );
+        }
+
+        delete Strg;
+    }
+
+    std::vector<BenchCase> Cases;
+    uint64 Checksum = 0;
+
+    for ( auto& [ Name, Code ] : Inputs )
+    {
+        uint32 Size = (uint32)Code.size();
+        Code.resize( Size + MaxInstructionSize, 0 );
+
+        uint32 Count = SweepDecode( Code.data(), Size, Checksum );
+        uint8* Bytes = Code.data();
+        Cases.push_back( { "decode/" + Name, { { "MB/s", 1.0 }, { "Minstr/s", Size ? (double)Count / Size : 0.0 } }, [Bytes, Size, &Checksum]( uint32 Samples )
+        {
+            return SampleThroughput( Samples, [&]()
+            {
+                SweepDecode( Bytes, Size, Checksum );
+                return Size;
+            } );
+        }, {} } );
+    }
+
+    const char* EngineNames[] = { "interp", "threaded", "blocks", "jit" };
+    std::vector<Storage*> Images;
+    Storage* Strg = new Storage{};
+
+    for ( auto& [ Name, Code ] : Inputs )
+    {
+        uint32 Size = (uint32)Code.size() - MaxInstructionSize;
+        if ( 0 == Name.compare( 0, 10, "synthetic/" ) && Name != "synthetic/loop" )
+        {
+            continue;
+        }
+
+        if ( !IsBenchSimulatable( Code.data(), Size ) )
+        {
+            printf( "%s: not simulated, it uses instructions the simulator does not run\n", Name.c_str() );
+            continue;
+        }
+
+        Storage* Image = new Storage{};
+        Images.push_back( Image );
+        uint16 ProgramSize = (uint16)Size;
+        memcpy( &Image->Memory[0], &ProgramSize, 2 );
+        memcpy( &Image->Memory[2], Code.data(), Size );
+
+        // The silent run counts nothing, so the instruction count comes from one interpreted run
+        uint64 InstructionCount = 0;
+        RestoreSnapshot( *Strg, *Image );
+        RunToIP( *Strg, UINT16_MAX, InstructionCount );
+
+        for ( uint8 Engine = 0; Engine <= (uint8)EngineKind::Jit; Engine++ )
+        {
+            Cases.push_back( { std::string( "sim/" ) + EngineNames[ Engine ] + "/" + Name, { { "MIPS", 1.0 } }, [=]( uint32 Samples )
+            {
+                return SampleSimThroughput( Samples, (EngineKind)Engine, *Strg, *Image, InstructionCount );
+            }, {} } );
+        }
+    }
+
+    // Load on a shared machine comes and goes over seconds, long enough to hold a benchmark
+    // below its baseline for all of its samples. So the samples are taken in rounds over every
+    // benchmark, and one that is slower still is measured again before it counts as a regression.
+    for ( uint32 Taken = 0; Taken < SampleCount; Taken += BenchRoundSamples )
+    {
+        for ( BenchCase& Case : Cases )
+        {
+            std::vector<double> More = Case.Sample( std::min( BenchRoundSamples, SampleCount - Taken ) );
+            Case.Samples.insert( Case.Samples.end(), More.begin(), More.end() );
+        }
+    }
+
+    for ( uint32 Retry = 0; Retry < BenchRetries && !Baseline.empty(); Retry++ )
+    {
+        bool Remeasured = false;
+        for ( BenchCase& Case : Cases )
+        {
+            if ( IsBenchCaseSlower( Case, Baseline, Threshold ) )
+            {
+                std::vector<double> More = Case.Sample( SampleCount );
+                Case.Samples.insert( Case.Samples.end(), More.begin(), More.end() );
+                Remeasured = true;
+            }
+        }
+
+        if ( !Remeasured )
+        {
+            break;
+        }
+    }
+
+    DeleteStorage( Strg );
+    for ( Storage* Image : Images )
+    {
+        delete Image;
+    }
+
+    std::vector<BenchResult> Results;
+    for ( const BenchCase& Case : Cases )
+    {
+        for ( const auto& [ Unit, Scale ] : Case.Units )
+        {
+            AddBenchResult( Results, Case.Name, Unit, Case.Samples, Scale );
+        }
+    }
+
+    printf( "%-40s %-9s %12s %12s %12s %12s\n", "Benchmark", "Unit", "Median", "P10", "P90", "Baseline" );
+
+    uint32 Regressions = 0;
+    std::vector<bool> Matched( Baseline.size(), false );
+    std::vector<std::string> Unmatched;
+    for ( const BenchResult& Result : Results )
+    {
+        printf( "%-40s %-9s %12.2f %12.2f %12.2f", Result.Name.c_str(), Result.Unit, Result.Median, Result.P10, Result.P90 );
+
+        std::string Key = Result.Name + " " + Result.Unit;
+        auto Found = std::find_if( Baseline.begin(), Baseline.end(), [&Key]( const BenchBaseline& Entry ) { return Entry.Key == Key; } );
+        if ( Found != Baseline.end() )
+        {
+            Matched[ Found - Baseline.begin() ] = true;
+            if ( Found->Median > 0.0 )
+            {
+                double Change = ( Result.Median - Found->Median ) / Found->Median;
+                bool IsRegression = IsBenchRegression( Result.Median, Result.P10, *Found, Threshold );
+                Regressions += IsRegression;
+                printf( " %+11.1f%%%s", Change * 100.0, IsRegression ? " REGRESSION" : "" );
+            }
+        }
+        else if ( BaselinePath )
+        {
+            Unmatched.push_back( Key );
+        }
+
+        printf( "\n" );
+    }
+
+    // A renamed or dropped benchmark would otherwise go unchecked without anyone noticing
+    for ( const std::string& Key : Unmatched )
+    {
+        printf( "ERROR: %s is not in the baseline %s!\n", Key.c_str(), BaselinePath );
+    }
+
+    uint32 Stale = 0;
+    for ( size_t i = 0; i < Baseline.size(); i++ )
+    {
+        if ( !Matched[i] )
+        {
+            printf( "ERROR: baseline entry %s has no result!\n", Baseline[i].Key.c_str() );
+            Stale++;
+        }
+    }
+
+    if ( SavePath )
+    {
+        FILE* SaveFile = fopen( SavePath, "w" );
+        if ( !SaveFile )
+        {
+            printf( "ERROR: cannot write %s!\n", SavePath );
+            return -1;
+        }
+
+        for ( const BenchResult& Result : Results )
+        {
+            fprintf( SaveFile, "%s %s %.4f %.4f\n", Result.Name.c_str(), Result.Unit, Result.Median, Result.P10 );
+        }
+
+        fclose( SaveFile );
+    }
+
+    // Keeps the decode sweeps from being optimized away
+    printf( "Benchmarks: %zu results, %u regressions, %zu not in the baseline, %u baseline entries without a result (checksum %llx)\n",
+            Results.size(), Regressions, Unmatched.size(), Stale, (unsigned long long)Checksum );
+
+    return Regressions || !Unmatched.empty() || Stale ? -1 : 0;
+}
+
+// Lockstep engine: one program run over many lanes, each with its own initial state. The
+// registers are kept as structure of arrays so that register ops run across all lanes with
+// one vector op per LaneWidth lanes. Lanes whose IP differs are masked off; each step runs
+// the lanes at the lowest IP, which lets lanes that split at a branch join again further on.
+#if SIM_LANE_SIMD == 2
+using LaneVector = __m256i;
+constexpr uint32 LaneWidth = 16;
+
+FORCEINLINE LaneVector LaneLoad( const uint16* Lanes ) { return _mm256_loadu_si256( (const __m256i*)Lanes ); }
+FORCEINLINE void LaneStore( uint16* Lanes, LaneVector V ) { _mm256_storeu_si256( (__m256i*)Lanes, V ); }
+FORCEINLINE LaneVector LaneSet( uint16 Value ) { return _mm256_set1_epi16( (short)Value ); }
+FORCEINLINE LaneVector LaneAdd( LaneVector A, LaneVector B ) { return _mm256_add_epi16( A, B ); }
+FORCEINLINE LaneVector LaneSub( LaneVector A, LaneVector B ) { return _mm256_sub_epi16( A, B ); }
+FORCEINLINE LaneVector LaneOr( LaneVector A, LaneVector B ) { return _mm256_or_si256( A, B ); }
+FORCEINLINE LaneVector LaneEqual( LaneVector A, LaneVector B ) { return _mm256_cmpeq_epi16( A, B ); }
+FORCEINLINE LaneVector LaneMin( LaneVector A, LaneVector B ) { return _mm256_min_epu16( A, B ); }
+FORCEINLINE LaneVector LaneSelect( LaneVector Mask, LaneVector A, LaneVector B ) { return _mm256_blendv_epi8( B, A, Mask ); }
+FORCEINLINE LaneVector LaneAndNot( LaneVector Mask, LaneVector A ) { return _mm256_andnot_si256( Mask, A ); }
+FORCEINLINE LaneVector LaneAnd( LaneVector A, LaneVector B ) { return _mm256_and_si256( A, B ); }
+FORCEINLINE LaneVector LaneSignMask( LaneVector A ) { return _mm256_srai_epi16( A, 15 ); }
+#elif SIM_LANE_SIMD == 1
+using LaneVector = __m128i;
+constexpr uint32 LaneWidth = 8;
+
+FORCEINLINE LaneVector LaneLoad( const uint16* Lanes ) { return _mm_loadu_si128( (const __m128i*)Lanes ); }
+FORCEINLINE void LaneStore( uint16* Lanes, LaneVector V ) { _mm_storeu_si128( (__m128i*)Lanes, V ); }
+FORCEINLINE LaneVector LaneSet( uint16 Value ) { return _mm_set1_epi16( (short)Value ); }
+FORCEINLINE LaneVector LaneAdd( LaneVector A, LaneVector B ) { return _mm_add_epi16( A, B ); }
+FORCEINLINE LaneVector LaneSub( LaneVector A, LaneVector B ) { return _mm_sub_epi16( A, B ); }
+FORCEINLINE LaneVector LaneOr( LaneVector A, LaneVector B ) { return _mm_or_si128( A, B ); }
+FORCEINLINE LaneVector LaneEqual( LaneVector A, LaneVector B ) { return _mm_cmpeq_epi16( A, B ); }
+FORCEINLINE LaneVector LaneSelect( LaneVector Mask, LaneVector A, LaneVector B ) { return _mm_or_si128( _mm_and_si128( Mask, A ), _mm_andnot_si128( Mask, B ) ); }
+FORCEINLINE LaneVector LaneAndNot( LaneVector Mask, LaneVector A ) { return _mm_andnot_si128( Mask, A ); }
+FORCEINLINE LaneVector LaneAnd( LaneVector A, LaneVector B ) { return _mm_and_si128( A, B ); }
+FORCEINLINE LaneVector LaneSignMask( LaneVector A ) { return _mm_srai_epi16( A, 15 ); }
+
+// SSE2 only has a signed 16-bit min
+FORCEINLINE LaneVector LaneMin( LaneVector A, LaneVector B )
+{
+    LaneVector Bias = _mm_set1_epi16( (short)0x8000 );
+    return _mm_xor_si128( _mm_min_epi16( _mm_xor_si128( A, Bias ), _mm_xor_si128( B, Bias ) ), Bias );
+}
+#else
+using LaneVector = uint16;
+constexpr uint32 LaneWidth = 1;
+
+FORCEINLINE LaneVector LaneLoad( const uint16* Lanes ) { return Lanes[0]; }
+FORCEINLINE void LaneStore( uint16* Lanes, LaneVector V ) { Lanes[0] = V; }
+FORCEINLINE LaneVector LaneSet( uint16 Value ) { return Value; }
+FORCEINLINE LaneVector LaneAdd( LaneVector A, LaneVector B ) { return A + B; }
+FORCEINLINE LaneVector LaneSub( LaneVector A, LaneVector B ) { return A - B; }
+FORCEINLINE LaneVector LaneOr( LaneVector A, LaneVector B ) { return A | B; }
+FORCEINLINE LaneVector LaneEqual( LaneVector A, LaneVector B ) { return A == B ? 0xffff : 0; }
+FORCEINLINE LaneVector LaneMin( LaneVector A, LaneVector B ) { return A < B ? A : B; }
+FORCEINLINE LaneVector LaneSelect( LaneVector Mask, LaneVector A, LaneVector B ) { return ( Mask & A ) | ( ~Mask & B ); }
+FORCEINLINE LaneVector LaneAndNot( LaneVector Mask, LaneVector A ) { return ~Mask & A; }
+FORCEINLINE LaneVector LaneAnd( LaneVector A, LaneVector B ) { return A & B; }
+FORCEINLINE LaneVector LaneSignMask( LaneVector A ) { return ( A & 0x8000 ) ? 0xffff : 0; }
+#endif
+
+// Guest memory of every lane: pages point into the shared image until a lane first writes
+// to them, which gives that lane its own copy
+constexpr uint32 LanePageShift = 8;
+constexpr uint32 LanePageSize = 1 << LanePageShift;
+constexpr uint32 LanePageCount = ( 1 << 16 ) >> LanePageShift;
+
+struct LaneMemory
+{
+    const uint8* Image;
+    uint16 CodeEnd;
+    std::vector<uint8*> Pages;
+    std::vector<uint8*> Copies;
+
+    // Lanes with a private copy of a page that holds program bytes, and how many there are
+    std::vector<bool> PrivateCode;
+    uint32 PrivateCodeLanes;
+};
+
+FORCEINLINE uint8 ReadLaneByte( const LaneMemory& Memory, uint32 Lane, uint16 Address )
+{
+    return Memory.Pages[ Lane * LanePageCount + ( Address >> LanePageShift ) ][ Address & ( LanePageSize - 1 ) ];
+}
+
+// Always reads a word, as LoadMemory does
+FORCEINLINE uint16 ReadLaneWord( const LaneMemory& Memory, uint32 Lane, uint16 Address )
+{
+    return ReadLaneByte( Memory, Lane, Address ) | ( ReadLaneByte( Memory, Lane, Address + 1 ) << 8 );
+}
+
+void WriteLaneByte( LaneMemory& Memory, uint32 Lane, uint16 Address, uint8 Value )
+{
+    uint32 PageIndex = Address >> LanePageShift;
+    uint8*& Page = Memory.Pages[ Lane * LanePageCount + PageIndex ];
+
+    const uint8* Shared = Memory.Image + ( PageIndex << LanePageShift );
+    if ( Page == Shared )
+    {
+        Page = new uint8[ LanePageSize ];
+        memcpy( Page, Shared, LanePageSize );
+        Memory.Copies.push_back( Page );
+
+        if ( ( PageIndex << LanePageShift ) < Memory.CodeEnd && !Memory.PrivateCode[ Lane ] )
+        {
+            Memory.PrivateCode[ Lane ] = true;
+            Memory.PrivateCodeLanes++;
+        }
+    }
+
+    Page[ Address & ( LanePageSize - 1 ) ] = Value;
+}
+
+void WriteLaneMemory( LaneMemory& Memory, uint32 Lane, uint16 Address, uint16 Value, bool IsWide )
+{
+    WriteLaneByte( Memory, Lane, Address, (uint8)( Value & 0x00ff ) );
+    if ( IsWide )
+    {
+        WriteLaneByte( Memory, Lane, Address + 1, (uint8)( Value >> 8 ) );
+    }
+}
+
+// Same hash as HashMemory over the lane's view of the address space
+uint64 HashLaneMemory( const LaneMemory& Memory, uint32 Lane )
+{
+    uint64 Hash = 14695981039346656037ull;
+    for ( uint32 PageIndex = 0; PageIndex < LanePageCount; PageIndex++ )
+    {
+        const uint8* Page = Memory.Pages[ Lane * LanePageCount + PageIndex ];
+        for ( uint32 i = 0; i < LanePageSize; i++ )
+        {
+            Hash = ( Hash ^ Page[i] ) * 1099511628211ull;
+        }
+    }
+
+    return Hash;
+}
+
+// Every per-lane array is padded to a multiple of LaneWidth; the padding lanes stay halted
+struct LaneState
+{
+    uint32 Count;
+    uint32 Padded;
+
+    std::vector<uint16> GPRs[ sizeof(GRegTableX) / sizeof(GRegTableX[0]) ];
+    std::vector<uint16> IP;
+
+    // RegisterFile's lazy flags, with LastFlagOp widened so that it can be blended
+    std::vector<uint16> LastFlagOp;
+    std::vector<uint16> FlagDst;
+    std::vector<uint16> FlagSrc;
+    std::vector<uint16> Flags;
+
+    // 0xffff for lanes that have stopped, and for lanes held back for one step because
+    // their own copy of the code differs from the instruction being run
+    std::vector<uint16> Halted;
+    std::vector<uint16> Held;
+};
+
+RegisterFile GetLaneRegisters( const LaneState& Lanes, uint32 Lane )
+{
+    RegisterFile RegFile{};
+    for ( uint8 Reg = 0; Reg < 8; Reg++ )
+    {
+        RegFile.GPRs[ Reg ] = Lanes.GPRs[ Reg ][ Lane ];
+    }
+
+    RegFile.IP = Lanes.IP[ Lane ];
+    RegFile.LastFlagOp = (FlagOp)Lanes.LastFlagOp[ Lane ];
+    RegFile.FlagDst = Lanes.FlagDst[ Lane ];
+    RegFile.FlagSrc = Lanes.FlagSrc[ Lane ];
+    RegFile.Flags = Lanes.Flags[ Lane ];
+
+    return RegFile;
+}
+
+void SetLaneRegisters( LaneState& Lanes, uint32 Lane, const RegisterFile& RegFile )
+{
+    for ( uint8 Reg = 0; Reg < 8; Reg++ )
+    {
+        Lanes.GPRs[ Reg ][ Lane ] = RegFile.GPRs[ Reg ];
+    }
+
+    Lanes.IP[ Lane ] = RegFile.IP;
+    Lanes.LastFlagOp[ Lane ] = (uint16)RegFile.LastFlagOp;
+    Lanes.FlagDst[ Lane ] = RegFile.FlagDst;
+    Lanes.FlagSrc[ Lane ] = RegFile.FlagSrc;
+    Lanes.Flags[ Lane ] = RegFile.Flags;
+}
+
+FORCEINLINE bool IsLaneActive( const LaneState& Lanes, uint32 Lane, uint16 IP )
+{
+    return ( Lanes.IP[ Lane ] | Lanes.Halted[ Lane ] | Lanes.Held[ Lane ] ) == IP;
+}
+
+// Count holds one per lane that ran, accumulated as 0 - Mask
+FORCEINLINE void AddLaneCounts( LaneVector Count, uint64& ActiveLanes )
+{
+    uint16 Counts[ LaneWidth ];
+    LaneStore( Counts, Count );
+    for ( uint16 Value : Counts )
+    {
+        ActiveLanes += Value;
+    }
+}
+
+// Register forms of MOV/ADD/SUB/CMP across every active lane
+void ExecuteLaneRegisterOp( LaneState& Lanes, const Instruction& Instr, uint16 IP, uint64& ActiveLanes )
+{
+    LaneVector Current = LaneSet( IP );
+    LaneVector Next = LaneSet( IP + Instr.ByteSize );
+    LaneVector Immediate = LaneSet( Instr.Immediate );
+    LaneVector Op = LaneSet( (uint16)( Instr.Name == IName::ADD ? FlagOp::Add : FlagOp::Sub ) );
+    LaneVector Count = LaneSet( 0 );
+
+    uint16* Dst = Lanes.GPRs[ Instr.Reg ].data();
+    const uint16* Src = Lanes.GPRs[ Instr.RegMem & 0b111 ].data();
+
+    for ( uint32 i = 0; i < Lanes.Padded; i += LaneWidth )
+    {
+        LaneVector Schedule = LaneOr( LaneOr( LaneLoad( &Lanes.IP[i] ), LaneLoad( &Lanes.Halted[i] ) ), LaneLoad( &Lanes.Held[i] ) );
+        LaneVector Mask = LaneEqual( Schedule, Current );
+
+        LaneVector DstValue = LaneLoad( &Dst[i] );
+        LaneVector SrcValue = Instr.Form == OperandForm::RegReg ? LaneLoad( &Src[i] ) : Immediate;
+
+        if ( Instr.Name != IName::CMP )
+        {
+            LaneVector Result = Instr.Name == IName::MOV ? SrcValue :
+                                Instr.Name == IName::ADD ? LaneAdd( DstValue, SrcValue ) : LaneSub( DstValue, SrcValue );
+            LaneStore( &Dst[i], LaneSelect( Mask, Result, DstValue ) );
+        }
+
+        if ( Instr.Name != IName::MOV )
+        {
+            LaneStore( &Lanes.LastFlagOp[i], LaneSelect( Mask, Op, LaneLoad( &Lanes.LastFlagOp[i] ) ) );
+            LaneStore( &Lanes.FlagDst[i], LaneSelect( Mask, DstValue, LaneLoad( &Lanes.FlagDst[i] ) ) );
+            LaneStore( &Lanes.FlagSrc[i], LaneSelect( Mask, SrcValue, LaneLoad( &Lanes.FlagSrc[i] ) ) );
+        }
+
+        LaneStore( &Lanes.IP[i], LaneSelect( Mask, Next, LaneLoad( &Lanes.IP[i] ) ) );
+        Count = LaneSub( Count, Mask );
+    }
+
+    AddLaneCounts( Count, ActiveLanes );
+}
+
+FORCEINLINE uint16 CalculateLaneAddress( const LaneState& Lanes, const Instruction& Instr, uint32 Lane )
+{
+    if ( Instr.RegMem & EaDirect )
+    {
+        return Instr.Displacement;
+    }
+
+    uint8 MemReg = Instr.RegMem & 0b111;
+    uint16 Address = Lanes.GPRs[ GMemRegTable1[ MemReg ] ][ Lane ] + Instr.Displacement;
+
+    uint8 Reg = GMemRegTable2[ MemReg ];
+    if ( Reg != UINT8_MAX )
+    {
+        Address += Lanes.GPRs[ Reg ][ Lane ];
+    }
+
+    return Address;
+}
+
+FORCEINLINE void SetLaneFlags( LaneState& Lanes, uint32 Lane, IName Name, uint16 Dst, uint16 Src )
+{
+    Lanes.LastFlagOp[ Lane ] = (uint16)( Name == IName::ADD ? FlagOp::Add : FlagOp::Sub );
+    Lanes.FlagDst[ Lane ] = Dst;
+    Lanes.FlagSrc[ Lane ] = Src;
+}
+
+// Memory forms, one lane at a time, with the semantics of ExecuteOperation
+void ExecuteLaneMemoryOp( LaneState& Lanes, LaneMemory& Memory, const Instruction& Instr, uint16 IP, uint64& ActiveLanes )
+{
+    for ( uint32 Lane = 0; Lane < Lanes.Count; Lane++ )
+    {
+        if ( !IsLaneActive( Lanes, Lane, IP ) )
+        {
+            continue;
+        }
+
+        ActiveLanes++;
+        Lanes.IP[ Lane ] = IP + Instr.ByteSize;
+
+        uint16 Address = CalculateLaneAddress( Lanes, Instr, Lane );
+        if ( Instr.Form == OperandForm::RegMem )
+        {
+            uint16& Reg = Lanes.GPRs[ Instr.Reg ][ Lane ];
+            uint16 Src = ReadLaneWord( Memory, Lane, Address );
+
+            if ( Instr.Name != IName::MOV )
+            {
+                SetLaneFlags( Lanes, Lane, Instr.Name, Reg, Src );
+            }
+
+            if ( Instr.Name != IName::CMP )
+            {
+                Reg = ExecuteAlu( Instr.Name, Reg, Src );
+            }
+
+            continue;
+        }
+
+        uint16 Src = Instr.Form == OperandForm::MemReg ? Lanes.GPRs[ Instr.Reg ][ Lane ] : Instr.Immediate;
+        if ( Instr.Name == IName::MOV )
+        {
+            WriteLaneMemory( Memory, Lane, Address, Src, Instr.Wide );
+            continue;
+        }
+
+        uint16 Dst = ReadLaneWord( Memory, Lane, Address );
+        if ( Instr.Name != IName::CMP )
+        {
+            WriteLaneMemory( Memory, Lane, Address, ExecuteAlu( Instr.Name, Dst, Src ), Instr.Wide );
+        }
+
+        SetLaneFlags( Lanes, Lane, Instr.Name, Dst, Src );
+    }
+}
+
+// Byte forms, one lane at a time on a RegisterFile of the lane, since the byte registers
+// are halves of the word lanes. The lanes only replay word ops lazily, so the flags of a
+// byte op are evaluated right away, as ForkLanes does for a snapshot taken after one.
+void ExecuteLaneByteOp( LaneState& Lanes, LaneMemory& Memory, const Instruction& Instr, uint16 IP, uint64& ActiveLanes )
+{
+    bool ToMemory = Instr.Form == OperandForm::MemReg || Instr.Form == OperandForm::MemImm;
+    bool FromMemory = Instr.Form == OperandForm::RegMem;
+
+    for ( uint32 Lane = 0; Lane < Lanes.Count; Lane++ )
+    {
+        if ( !IsLaneActive( Lanes, Lane, IP ) )
+        {
+            continue;
+        }
+
+        ActiveLanes++;
+
+        RegisterFile RegFile = GetLaneRegisters( Lanes, Lane );
+        RegFile.IP = IP + Instr.ByteSize;
+
+        uint16 Address = ToMemory || FromMemory ? CalculateLaneAddress( Lanes, Instr, Lane ) : 0;
+        uint8& Reg = GetRegister<false>( RegFile, Instr.Reg );
+
+        uint8 Dst = ToMemory ? ReadLaneByte( Memory, Lane, Address ) : Reg;
+        uint8 Src = (uint8)Instr.Immediate;
+        if ( Instr.Form == OperandForm::RegReg )
+        {
+            Src = GetRegister<false>( RegFile, Instr.RegMem );
+        }
+        else if ( FromMemory )
+        {
+            Src = ReadLaneByte( Memory, Lane, Address );
+        }
+        else if ( Instr.Form == OperandForm::MemReg )
+        {
+            Src = Reg;
+        }
+
+        if ( Instr.Name != IName::CMP )
+        {
+            uint8 Result = (uint8)ExecuteAlu( Instr.Name, Dst, Src );
+            if ( ToMemory )
+            {
+                WriteLaneByte( Memory, Lane, Address, Result );
+            }
+            else
+            {
+                Reg = Result;
+            }
+        }
+
+        if ( Instr.Name != IName::MOV )
+        {
+            SetFlags<TraceLevel::Off, false>( Instr.Name, Dst, Src, RegFile );
+            RegFile.Flags = EvaluateFlags( RegFile );
+            RegFile.LastFlagOp = FlagOp::None;
+        }
+
+        SetLaneRegisters( Lanes, Lane, RegFile );
+    }
+}
+
+// All ones in the lanes whose ZF (or SF) is set, evaluated lazily like EvaluateFlags
+FORCEINLINE LaneVector EvaluateLaneFlag( const LaneState& Lanes, uint32 i, uint16 Flag )
+{
+    LaneVector Op = LaneLoad( &Lanes.LastFlagOp[i] );
+    LaneVector Dst = LaneLoad( &Lanes.FlagDst[i] );
+    LaneVector Src = LaneLoad( &Lanes.FlagSrc[i] );
+
+    LaneVector IsAdd = LaneEqual( Op, LaneSet( (uint16)FlagOp::Add ) );
+    LaneVector IsSub = LaneEqual( Op, LaneSet( (uint16)FlagOp::Sub ) );
+    LaneVector Result = LaneSelect( IsAdd, LaneAdd( Dst, Src ), LaneSub( Dst, Src ) );
+
+    LaneVector Lazy = Flag == FlagZF ? LaneEqual( Result, LaneSet( 0 ) ) : LaneSignMask( Result );
+    LaneVector Evaluated = LaneEqual( LaneAnd( LaneLoad( &Lanes.Flags[i] ), LaneSet( Flag ) ), LaneSet( Flag ) );
+
+    return LaneSelect( LaneOr( IsAdd, IsSub ), Lazy, Evaluated );
+}
+
+void ExecuteLaneJump( LaneState& Lanes, const Instruction& Instr, uint16 IP, uint64& ActiveLanes )
+{
+    uint16 Next = IP + Instr.ByteSize;
+    uint16 Target = Next + static_cast<int8>( Instr.Displacement );
+
+    // Loops mostly close on ZF or SF, which are cheap to evaluate across lanes
+    if ( Instr.Name == IName::JE || Instr.Name == IName::JNE || Instr.Name == IName::JS || Instr.Name == IName::JNS )
+    {
+        uint16 Flag = Instr.Name == IName::JE || Instr.Name == IName::JNE ? FlagZF : FlagSF;
+        bool Negate = Instr.Name == IName::JNE || Instr.Name == IName::JNS;
+        LaneVector Count = LaneSet( 0 );
+
+        for ( uint32 i = 0; i < Lanes.Padded; i += LaneWidth )
+        {
+            LaneVector Schedule = LaneOr( LaneOr( LaneLoad( &Lanes.IP[i] ), LaneLoad( &Lanes.Halted[i] ) ), LaneLoad( &Lanes.Held[i] ) );
+            LaneVector Mask = LaneEqual( Schedule, LaneSet( IP ) );
+
+            LaneVector Set = EvaluateLaneFlag( Lanes, i, Flag );
+            LaneVector Taken = Negate ? LaneAndNot( Set, LaneSet( 0xffff ) ) : Set;
+            LaneVector NewIP = LaneSelect( Taken, LaneSet( Target ), LaneSet( Next ) );
+
+            LaneStore( &Lanes.IP[i], LaneSelect( Mask, NewIP, LaneLoad( &Lanes.IP[i] ) ) );
+            Count = LaneSub( Count, Mask );
+        }
+
+        AddLaneCounts( Count, ActiveLanes );
+
+        return;
+    }
+
+    bool IsImplemented = IsJumpImplemented( Instr.Name );
+
+    for ( uint32 Lane = 0; Lane < Lanes.Count; Lane++ )
+    {
+        if ( !IsLaneActive( Lanes, Lane, IP ) )
+        {
+            continue;
+        }
+
+        ActiveLanes++;
+        Lanes.IP[ Lane ] = Next;
+
+        if ( IsImplemented && IsJumpTaken( Instr.Name, GetLaneRegisters( Lanes, Lane ) ) )
+        {
+            Lanes.IP[ Lane ] = Target;
+        }
+    }
+
+    if ( !IsImplemented )
+    {
+        printf( "ERROR: JMP instruction not implemented!\n" );
+    }
+}
+
+// Lanes that own a copy of the code at IP and hold different bytes than the instruction about
+// to run sit this step out. If the reference lane is one of them, its bytes are decoded instead.
+Instruction SelectLaneInstruction( LaneState& Lanes, const LaneMemory& Memory, DecodeCache& Cache, uint16 IP, std::vector<uint32>& HeldLanes )
+{
+    uint8 Bytes[ MaxInstructionSize ];
+    bool HasReference = false;
+    Instruction Instr{};
+
+    for ( uint32 Lane = 0; Lane < Lanes.Count; Lane++ )
+    {
+        if ( !IsLaneActive( Lanes, Lane, IP ) )
+        {
+            continue;
+        }
+
+        if ( !HasReference )
+        {
+            for ( uint16 i = 0; i < MaxInstructionSize; i++ )
+            {
+                Bytes[i] = ReadLaneByte( Memory, Lane, 2 + IP + i );
+            }
+
+            Instr = Memory.PrivateCode[ Lane ] ? DecodeInstruction( Bytes ) : FetchInstruction( Cache, Memory.Image, 2 + IP );
+            HasReference = true;
+            continue;
+        }
+
+        if ( !Memory.PrivateCode[ Lane ] && memcmp( Bytes, Memory.Image + 2 + IP, Instr.ByteSize ) == 0 )
+        {
+            continue;
+        }
+
+        for ( uint16 i = 0; i < Instr.ByteSize; i++ )
+        {
+            if ( ReadLaneByte( Memory, Lane, 2 + IP + i ) != Bytes[i] )
+            {
+                Lanes.Held[ Lane ] = 0xffff;
+                HeldLanes.push_back( Lane );
+                break;
+            }
+        }
+    }
+
+    return Instr;
+}
+
+struct LaneSweep
+{
+    bool IsMemory;
+    uint16 Target;
+    uint16 Start;
+    uint16 Step;
+};
+
+struct LockstepStats
+{
+    uint64 Steps;
+    uint64 LaneInstructions;
+};
+
+LockstepStats SimulateLockstep8086( LaneState& Lanes, LaneMemory& Memory )
+{
+    const uint16 ProgramSize = *(const uint16*)&Memory.Image[0];
+    LockstepStats Stats{};
+
+    DecodeCache* Cache = new DecodeCache{};
+    std::vector<uint32> HeldLanes;
+
+    for (;;)
+    {
+        LaneVector Lowest = LaneSet( 0xffff );
+        for ( uint32 i = 0; i < Lanes.Padded; i += LaneWidth )
+        {
+            Lowest = LaneMin( Lowest, LaneOr( LaneLoad( &Lanes.IP[i] ), LaneLoad( &Lanes.Halted[i] ) ) );
+        }
+
+        uint16 Values[ LaneWidth ];
+        LaneStore( Values, Lowest );
+
+        uint16 IP = 0xffff;
+        for ( uint16 Value : Values )
+        {
+            IP = Value < IP ? Value : IP;
+        }
+
+        if ( IP >= ProgramSize )
+        {
+            break;
+        }
+
+        Instruction Instr = Memory.PrivateCodeLanes ? SelectLaneInstruction( Lanes, Memory, *Cache, IP, HeldLanes )
+                                                    : FetchInstruction( *Cache, Memory.Image, 2 + IP );
+
+        if ( Instr.Name == IName::UNKNOWN || IsSegmentForm( Instr.Form ) )
+        {
+            if ( Instr.Name == IName::UNKNOWN )
+            {
+                printf( "ERROR: Unknown instruction 0x%02x at IP %d!\n", Memory.Image[ 2 + IP ], IP );
+            }
+            else
+            {
+                printf( "ERROR: Segment registers are not supported by lockstep lanes, at IP %d!\n", IP );
+            }
+
+            for ( uint32 Lane = 0; Lane < Lanes.Count; Lane++ )
+            {
+                if ( IsLaneActive( Lanes, Lane, IP ) )
+                {
+                    Lanes.Halted[ Lane ] = 0xffff;
+                }
+            }
+        }
+        else if ( Instr.Form == OperandForm::Rel8 )
+        {
+            ExecuteLaneJump( Lanes, Instr, IP, Stats.LaneInstructions );
+        }
+        else if ( !Instr.Wide && !IsWordRegisterByteStore( Instr ) )
+        {
+            ExecuteLaneByteOp( Lanes, Memory, Instr, IP, Stats.LaneInstructions );
+        }
+        else if ( Instr.Form == OperandForm::RegReg || Instr.Form == OperandForm::RegImm )
+        {
+            ExecuteLaneRegisterOp( Lanes, Instr, IP, Stats.LaneInstructions );
+        }
+        else
+        {
+            ExecuteLaneMemoryOp( Lanes, Memory, Instr, IP, Stats.LaneInstructions );
+        }
+
+        for ( uint32 Lane : HeldLanes )
+        {
+            Lanes.Held[ Lane ] = 0;
+        }
+
+        HeldLanes.clear();
+        Stats.Steps++;
+    }
+
+    delete Cache;
+
+    return Stats;
+}
+
+// Forks LaneCount children from Snapshot, applying each sweep to lane i as Start + i * Step.
+// Every lane starts with the snapshot's registers and shares its memory pages until it
+// writes to them.
+void ForkLanes( const Storage& Snapshot, uint32 LaneCount, const std::vector<LaneSweep>& Sweeps, LaneState& Lanes, LaneMemory& Memory )
+{
+    Lanes.Count = LaneCount;
+    Lanes.Padded = ( LaneCount + LaneWidth - 1 ) / LaneWidth * LaneWidth;
+
+    for ( uint8 Reg = 0; Reg < 8; Reg++ )
+    {
+        Lanes.GPRs[ Reg ].assign( Lanes.Padded, Snapshot.RegFile.GPRs[ Reg ] );
+    }
+
+    // Lanes only replay word ops lazily, so flags left by a byte op are evaluated up front
+    RegisterFile Seed = Snapshot.RegFile;
+    if ( Seed.LastFlagOp == FlagOp::Add8 || Seed.LastFlagOp == FlagOp::Sub8 )
+    {
+        Seed.Flags = EvaluateFlags( Seed );
+        Seed.LastFlagOp = FlagOp::None;
+    }
+
+    Lanes.IP.assign( Lanes.Padded, Seed.IP );
+    Lanes.LastFlagOp.assign( Lanes.Padded, (uint16)Seed.LastFlagOp );
+    Lanes.FlagDst.assign( Lanes.Padded, Seed.FlagDst );
+    Lanes.FlagSrc.assign( Lanes.Padded, Seed.FlagSrc );
+    Lanes.Flags.assign( Lanes.Padded, Seed.Flags );
+    Lanes.Held.assign( Lanes.Padded, 0 );
+
+    Lanes.Halted.assign( Lanes.Padded, 0xffff );
+    std::fill( Lanes.Halted.begin(), Lanes.Halted.begin() + LaneCount, 0 );
+
+    Memory.Image = Snapshot.Memory;
+    Memory.CodeEnd = 2 + *(const uint16*)&Snapshot.Memory[0];
+    Memory.PrivateCode.assign( LaneCount, false );
+    Memory.PrivateCodeLanes = 0;
+    Memory.Pages.resize( (size_t)LaneCount * LanePageCount );
+
+    for ( uint32 Lane = 0; Lane < LaneCount; Lane++ )
+    {
+        for ( uint32 PageIndex = 0; PageIndex < LanePageCount; PageIndex++ )
+        {
+            // Never written through while shared, WriteLaneByte copies the page first
+            Memory.Pages[ Lane * LanePageCount + PageIndex ] = const_cast<uint8*>( Snapshot.Memory ) + ( PageIndex << LanePageShift );
+        }
+
+        for ( const LaneSweep& Sweep : Sweeps )
+        {
+            uint16 Value = Sweep.Start + Lane * Sweep.Step;
+            if ( Sweep.IsMemory )
+            {
+                WriteLaneMemory( Memory, Lane, Sweep.Target, Value, true );
+            }
+            else
+            {
+                Lanes.GPRs[ Sweep.Target ][ Lane ] = Value;
+            }
+        }
+    }
+}
+
+// Runs the program once per lane and prints the final state of every lane. With a ForkIP the
+// common prefix up to that IP is interpreted once and the lanes are forked from a snapshot
+// taken there.
+int RunLockstep( const char* FileName, uint32 LaneCount, const std::vector<LaneSweep>& Sweeps, int32 ForkIP )
+{
+    Storage* Image = new Storage{};
+    if ( !LoadProgram( FileName, *Image ) )
+    {
+        delete Image;
+        return -1;
+    }
+
+    uint64 PrefixInstructions = 0;
+    if ( ForkIP >= 0 && !RunToIP( *Image, (uint16)ForkIP, PrefixInstructions ) )
+    {
+        printf( "ERROR: IP %d is never reached!\n", ForkIP );
+        DeleteStorage( Image );
+        return -1;
+    }
+
+    // Lanes address a flat 64KB each
+    if ( HasHighPages( *Image ) || Image->RegFile.Segs[ SegES ] | Image->RegFile.Segs[ SegCS ] | Image->RegFile.Segs[ SegSS ] | Image->RegFile.Segs[ SegDS ] )
+    {
+        printf( "ERROR: lanes cannot be forked after the program has used segment registers!\n" );
+        DeleteStorage( Image );
+        return -1;
+    }
+
+    Storage* Snapshot = TakeSnapshot( *Image );
+    delete Image;
+
+    LaneState Lanes{};
+    LaneMemory Memory{};
+    ForkLanes( *Snapshot, LaneCount, Sweeps, Lanes, Memory );
+
+    auto StartTime = std::chrono::steady_clock::now();
+
+    LockstepStats Stats = SimulateLockstep8086( Lanes, Memory );
+
+    double Seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - StartTime ).count();
+
+    for ( uint32 Lane = 0; Lane < LaneCount; Lane++ )
+    {
+        char Name[ 32 ];
+        snprintf( Name, sizeof( Name ), "lane %u", Lane );
+        PrintResultRecord( Name, GetLaneRegisters( Lanes, Lane ), HashLaneMemory( Memory, Lane ) );
+    }
+
+    printf( "Lockstep: %u lanes, %u per vector, %llu steps, %llu lane instructions (%.1f lanes per step) in %.3f ms (%.2f MIPS)\n",
+            LaneCount, LaneWidth, (unsigned long long)Stats.Steps, (unsigned long long)Stats.LaneInstructions,
+            Stats.Steps ? (double)Stats.LaneInstructions / Stats.Steps : 0.0, Seconds * 1000.0,
+            Seconds > 0.0 ? Stats.LaneInstructions / Seconds / 1e6 : 0.0 );
+
+    if ( ForkIP >= 0 )
+    {
+        printf( "Forked at IP %d after %llu instructions: %zu private pages, %zu shared\n",
+                ForkIP, (unsigned long long)PrefixInstructions, Memory.Copies.size(),
+                Memory.Pages.size() - Memory.Copies.size() );
+    }
+
+    for ( uint8* Copy : Memory.Copies )
+    {
+        delete[] Copy;
+    }
+
+    delete Snapshot;
+
+    return 0;
+}
+
+int main( int argc, char** argv )
+{
+    if ( argc < 2 )
+    {
+        return -1;
+    }
+
+    // "-batch <directory or list file>", "-bench <directory or list file>" and
+    // "-schedule <directory or list file>" take the place of the program file
+    bool IsBatch = 0 == strcmp( argv[1], "-batch" );
+    bool IsBench = 0 == strcmp( argv[1], "-bench" );
+    bool IsSchedule = 0 == strcmp( argv[1], "-schedule" );
+    bool IsMulti = IsBatch || IsBench || IsSchedule;
+    if ( IsMulti && argc < 3 )
+    {
+        return -1;
+    }
+
+    const char* FileName = IsMulti ? argv[2] : argv[1];
+
+    // "-decode-trace <trace file>" prints a binary trace written with -trace-out as text
+    if ( 0 == strcmp( argv[1], "-decode-trace" ) )
+    {
+        return argc < 3 ? -1 : DecodeTrace( argv[2] );
+    }
+
+    TraceLevel Level = TraceLevel::Full;
+    EngineKind Engine = EngineKind::Interpreter;
+    bool EnableProfile = false;
+    uint32 ThreadCount = std::max( 1u, std::thread::hardware_concurrency() );
+    uint32 LaneCount = 0;
+    int32 ForkIP = -1;
+    const char* DumpPath = "mem_dump.bin";
+    DumpFormat Dump = DumpFormat::Full;
+    const char* DeltaPath = nullptr;
+    uint32 DeltaInterval = 1;
+    const char* TracePath = nullptr;
+    uint32 ValidateInterval = 0;
+
+    // The -frame options fill this in, in any order; Frames points at it once -framebuffer is given
+    FrameExport FrameSetup{};
+    FrameSetup.Prefix = "frame";
+    FrameSetup.Interval = 10000;
+    FrameExport* Frames = nullptr;
+    bool Disassemble = false;
+    const char* CfgPath = nullptr;
+    uint32 SampleCount = 15;
+    const char* BaselinePath = nullptr;
+    const char* SaveBaselinePath = nullptr;
+    double Threshold = 0.1;
+    uint32 Copies = 1;
+    uint64 Slice = 10000;
+    uint64 Timeout = 10000000;
+    bool BudgetInClocks = false;
+    std::vector<LaneSweep> Sweeps;
+    for ( int i = IsMulti ? 3 : 2; i < argc; i++ )
+    {
+        if ( 0 == strcmp( argv[i], "-trace" ) && i + 1 < argc )
+        {
+            const char* LevelName = argv[++i];
+            if ( 0 == strcmp( LevelName, "off" ) )
+            {
+                Level = TraceLevel::Off;
+            }
+            else if ( 0 == strcmp( LevelName, "summary" ) )
+            {
+                Level = TraceLevel::Summary;
+            }
+            else if ( 0 == strcmp( LevelName, "full" ) )
+            {
+                Level = TraceLevel::Full;
+            }
+            else
+            {
+                printf( "ERROR: unknown trace level %s!\n", LevelName );
+                return -1;
+            }
+        }
+        else if ( 0 == strcmp( argv[i], "-engine" ) && i + 1 < argc )
+        {
+            const char* EngineName = argv[++i];
+            if ( 0 == strcmp( EngineName, "interp" ) )
+            {
+                Engine = EngineKind::Interpreter;
+            }
+            else if ( 0 == strcmp( EngineName, "threaded" ) )
+            {
+                Engine = EngineKind::Threaded;
+            }
+            else if ( 0 == strcmp( EngineName, "blocks" ) )
+            {
+                Engine = EngineKind::Blocks;
+            }
+            else if ( 0 == strcmp( EngineName, "jit" ) )
+            {
+                Engine = EngineKind::Jit;
+            }
+            else
+            {
+                printf( "ERROR: unknown engine %s!\n", EngineName );
+                return -1;
+            }
+        }
+        else if ( 0 == strcmp( argv[i], "-profile" ) )
+        {
+            EnableProfile = true;
+        }
+        else if ( 0 == strcmp( argv[i], "-threads" ) && i + 1 < argc )
+        {
+            ThreadCount = std::max( 1, atoi( argv[++i] ) );
+        }
+        else if ( 0 == strcmp( argv[i], "-lanes" ) && i + 1 < argc )
         {
-            if ( RegFile.SF )
-            {
-                RegFile.IP += static_cast<int8>( Instr.Displacement );
-            }
-
-            return;
+            LaneCount = std::max( 1, atoi( argv[++i] ) );
         }
-
-    case IName::JNB:
-    case IName::JLE:
+        else if ( 0 == strcmp( argv[i], "-dump" ) && i + 1 < argc )
         {
-            if ( RegFile.SF || RegFile.ZF )
-            {
-                RegFile.IP += static_cast<int8>( Instr.Displacement );
-            }
-
-            return;
+            DumpPath = argv[++i];
         }
-
-    case IName::JNS:
-    case IName::JNLE:
-    case IName::JB:
+        else if ( 0 == strcmp( argv[i], "-dump-format" ) && i + 1 < argc )
         {
-            if ( !RegFile.SF )
+            const char* FormatName = argv[++i];
+            if ( 0 == strcmp( FormatName, "none" ) )
             {
-                RegFile.IP += static_cast<int8>( Instr.Displacement );
+                Dump = DumpFormat::None;
             }
-
-            return;
-        }
-
-    case IName::JNL:
-    case IName::JBE:
-        {
-            if ( !RegFile.SF || RegFile.ZF )
+            else if ( 0 == strcmp( FormatName, "full" ) )
             {
-                RegFile.IP += static_cast<int8>( Instr.Displacement );
+                Dump = DumpFormat::Full;
             }
-
-            return;
-        }
-
-    case IName::JNE:
-        {
-            if ( !RegFile.ZF )
+            else if ( 0 == strcmp( FormatName, "sparse" ) )
             {
-                RegFile.IP += static_cast<int8>( Instr.Displacement );
+                Dump = DumpFormat::Sparse;
+            }
+            else if ( 0 == strcmp( FormatName, "ranges" ) )
+            {
+                Dump = DumpFormat::Ranges;
+            }
+            else
+            {
+                printf( "ERROR: unknown dump format %s!\n", FormatName );
+                return -1;
             }
-
-            return;
         }
-
-    default:
+        else if ( 0 == strcmp( argv[i], "-deltas" ) && i + 1 < argc )
         {
-            if ( Instr.Name >= IName::JE )
+            DeltaPath = argv[++i];
+        }
+        else if ( 0 == strcmp( argv[i], "-delta-interval" ) && i + 1 < argc )
+        {
+            DeltaInterval = std::max( 1, atoi( argv[++i] ) );
+        }
+        else if ( 0 == strcmp( argv[i], "-trace-out" ) && i + 1 < argc )
+        {
+            TracePath = argv[++i];
+        }
+        else if ( 0 == strcmp( argv[i], "-framebuffer" ) && i + 4 < argc )
+        {
+            Frames = &FrameSetup;
+            Frames->Base = (uint16)strtol( argv[i + 1], nullptr, 0 );
+            Frames->Width = (uint16)atoi( argv[i + 2] );
+            Frames->Height = (uint16)atoi( argv[i + 3] );
+
+            const char* FormatName = argv[i + 4];
+            i += 4;
+
+            if ( 0 == strcmp( FormatName, "rgba32" ) )
             {
-                printf( "ERROR: JMP instruction not implemented!\n" );
+                Frames->Format = PixelFormat::Rgba32;
+            }
+            else if ( 0 == strcmp( FormatName, "rgb24" ) )
+            {
+                Frames->Format = PixelFormat::Rgb24;
+            }
+            else if ( 0 == strcmp( FormatName, "gray8" ) )
+            {
+                Frames->Format = PixelFormat::Gray8;
+            }
+            else
+            {
+                printf( "ERROR: unknown pixel format %s!\n", FormatName );
+                return -1;
             }
-
-            break;
         }
-    }
-}
-
-Instruction DecodeInstruction( const uint8* InstrPtr )
-{
-    Instruction Instr{};
-    switch ( InstrPtr[0] >> 2 )
-    {
-    case 0b100010:
+        else if ( 0 == strcmp( argv[i], "-frame-out" ) && i + 1 < argc )
         {
-            Instr.Name = IName::MOV;
-            DecodeRegToRegMem( InstrPtr, Instr );
-            return Instr;
+            FrameSetup.Prefix = argv[++i];
         }
-
-    case 0b000000:
+        else if ( 0 == strcmp( argv[i], "-frame-interval" ) && i + 1 < argc )
         {
-            Instr.Name = IName::ADD;
-            DecodeRegToRegMem( InstrPtr, Instr );
-            return Instr;
+            FrameSetup.Interval = std::max( 1, atoi( argv[++i] ) );
+            FrameSetup.IntervalInClocks = false;
         }
-
-    case 0b001010:
+        else if ( 0 == strcmp( argv[i], "-frame-clocks" ) && i + 1 < argc )
         {
-            Instr.Name = IName::SUB;
-            DecodeRegToRegMem( InstrPtr, Instr );
-            return Instr;
+            FrameSetup.Interval = std::max( 1, atoi( argv[++i] ) );
+            FrameSetup.IntervalInClocks = true;
         }
-
-    case 0b001110:
+        else if ( 0 == strcmp( argv[i], "-validate" ) && i + 1 < argc )
         {
-            Instr.Name = IName::CMP;
-            DecodeRegToRegMem( InstrPtr, Instr );
-            return Instr;
+            ValidateInterval = std::max( 1, atoi( argv[++i] ) );
         }
-
-    case 0b000001:
+        else if ( 0 == strcmp( argv[i], "-samples" ) && i + 1 < argc )
         {
-            Instr.Name = IName::ADD;
-            Instr.Wide = InstrPtr[0] & 0b00000001;
-
-            Instr.RegDst = 0;
-            Instr.Immediate = Instr.Wide ? *(uint16*)&InstrPtr[1] : InstrPtr[1];
-
-            Instr.ByteSize = Instr.Wide ? 3 : 2;
-
-            return Instr;
+            SampleCount = std::max( 1, atoi( argv[++i] ) );
         }
-
-    case 0b001011:
+        else if ( 0 == strcmp( argv[i], "-baseline" ) && i + 1 < argc )
         {
-            Instr.Name = IName::SUB;
-            Instr.Wide = InstrPtr[0] & 0b00000001;
-
-            Instr.RegDst = 0;
-            Instr.Immediate = Instr.Wide ? *(uint16*)&InstrPtr[1] : InstrPtr[1];
-
-            Instr.ByteSize = Instr.Wide ? 3 : 2;
-
-            return Instr;
+            BaselinePath = argv[++i];
         }
-
-    case 0b001111:
+        else if ( 0 == strcmp( argv[i], "-save-baseline" ) && i + 1 < argc )
         {
-            Instr.Name = IName::CMP;
-            Instr.Wide = InstrPtr[0] & 0b00000001;
-
-            Instr.RegDst = 0;
-            Instr.Immediate = Instr.Wide ? *(uint16*)&InstrPtr[1] : InstrPtr[1];
-
-            Instr.ByteSize = Instr.Wide ? 3 : 2;
-
-            return Instr;
+            SaveBaselinePath = argv[++i];
         }
-
-    case 0b100000:
+        else if ( 0 == strcmp( argv[i], "-threshold" ) && i + 1 < argc )
         {
-            Instr.Wide = InstrPtr[0] & 0b00000001;
-            if ( 0 == ((InstrPtr[1] >> 3) & 0b00111) )
-            {
-                Instr.Name = IName::ADD;
-                DecodeImmToRegMem( InstrPtr, Instr, Instr.Wide && !(InstrPtr[0] & 0b00000010) );
-            }
-            else if ( 0b101 == ((InstrPtr[1] >> 3) & 0b00111) )
+            // Allowed drop of a median below its baseline, in percent
+            Threshold = atof( argv[++i] ) / 100.0;
+        }
+        else if ( 0 == strcmp( argv[i], "-copies" ) && i + 1 < argc )
+        {
+            Copies = std::max( 1, atoi( argv[++i] ) );
+        }
+        else if ( 0 == strcmp( argv[i], "-slice" ) && i + 1 < argc )
+        {
+            Slice = std::max( 1ll, atoll( argv[++i] ) );
+        }
+        else if ( 0 == strcmp( argv[i], "-timeout" ) && i + 1 < argc )
+        {
+            // 0 lets guests run until they halt or fault
+            Timeout = std::max( 0ll, atoll( argv[++i] ) );
+        }
+        else if ( 0 == strcmp( argv[i], "-clocks" ) )
+        {
+            BudgetInClocks = true;
+        }
+        else if ( 0 == strcmp( argv[i], "-disasm" ) )
+        {
+            Disassemble = true;
+        }
+        else if ( 0 == strcmp( argv[i], "-cfg" ) && i + 1 < argc )
+        {
+            CfgPath = argv[++i];
+        }
+        else if ( 0 == strcmp( argv[i], "-fork-at" ) && i + 1 < argc )
+        {
+            // The lanes share the pages of the snapshot taken at this IP until they store to
+            // them. They address a flat 64KB each, so a prefix that has used segment registers
+            // or memory above 64KB can not be forked.
+            ForkIP = (uint16)strtol( argv[++i], nullptr, 0 );
+        }
+        else if ( 0 == strcmp( argv[i], "-sweep" ) && i + 3 < argc )
+        {
+            // -sweep <register or [address]> <start> <step>
+            const char* Target = argv[++i];
+            LaneSweep Sweep{ Target[0] == '[', 0, (uint16)strtol( argv[i + 1], nullptr, 0 ), (uint16)strtol( argv[i + 2], nullptr, 0 ) };
+            i += 2;
+
+            if ( Sweep.IsMemory )
             {
-                Instr.Name = IName::SUB;
-                DecodeImmToRegMem( InstrPtr, Instr, Instr.Wide && !(InstrPtr[0] & 0b00000010) );
+                Sweep.Target = (uint16)strtol( Target + 1, nullptr, 0 );
             }
-            else if ( 0b111 == ((InstrPtr[1] >> 3) & 0b00111) )
+            else
             {
-                Instr.Name = IName::CMP;
-                DecodeImmToRegMem( InstrPtr, Instr, Instr.Wide && !(InstrPtr[0] & 0b00000010) );
+                uint8 Reg = 0;
+                while ( Reg < 8 && 0 != strcmp( Target, GRegTableX[ Reg ] ) )
+                {
+                    Reg++;
+                }
+
+                if ( Reg == 8 )
+                {
+                    printf( "ERROR: unknown sweep target %s!\n", Target );
+                    return -1;
+                }
+
+                Sweep.Target = Reg;
             }
 
-            return Instr;
+            Sweeps.push_back( Sweep );
         }
-
-    default:
-        break;
     }
 
-    if ( 0b1100011 == (InstrPtr[0] >> 1) )
+    if ( IsSchedule )
     {
-        Instr.Name = IName::MOV;
-        Instr.Wide = InstrPtr[0] & 0b00000001;
-        DecodeImmToRegMem( InstrPtr, Instr, Instr.Wide );
-        return Instr;
+        return RunSchedule( FileName, Copies, ThreadCount, Slice, Timeout, BudgetInClocks );
     }
-    else if ( 0b1011 == (InstrPtr[0] >> 4) )
-    {
-        uint8 Reg = InstrPtr[0] & 0b00000111;
-        Instr.Wide = InstrPtr[0] & 0b00001000;
 
-        Instr.Name = IName::MOV;
-        Instr.RegDst = Reg;
-        Instr.Immediate = Instr.Wide ? *(uint16*)&InstrPtr[1] : InstrPtr[1];
-
-        Instr.ByteSize = Instr.Wide ? 3 : 2;
-        return Instr;
+    if ( IsBench )
+    {
+        return RunBenchmarks( FileName, SampleCount, BaselinePath, SaveBaselinePath, Threshold );
     }
 
-    DecodeJump( InstrPtr, Instr );
-
-    return Instr;
-}
-
-void PrintInstruction( const Instruction& Instr )
-{
-    printf( "%s", InstrNames[ (uint16)Instr.Name ] );
-
-    if ( Instr.Name >= IName::JE )
+    if ( Disassemble )
     {
-        printf( " %d\n", static_cast<int8>( Instr.Displacement ) );
-        return;
+        return DisassembleProgram( FileName, ThreadCount );
     }
 
-    // Print destination
-    if ( Instr.RegDst != UINT8_MAX )
+    if ( CfgPath )
     {
-        printf( " %s", GetRegisterName( Instr.RegDst, Instr.Wide ) );
+        return ExportControlFlow( FileName, CfgPath );
     }
-    else if ( Instr.MemRegDst != UINT8_MAX && Instr.DisplDst != UINT8_MAX )
+
+    // Forking without -lanes runs a single child from the snapshot
+    if ( LaneCount || ForkIP >= 0 )
     {
-        printf( " [%s + %d]", GRegMemTable[ Instr.MemRegDst ], Instr.DisplDst );
+        return RunLockstep( FileName, std::max( 1u, LaneCount ), Sweeps, ForkIP );
     }
-    else if ( Instr.MemRegDst != UINT8_MAX )
+
+    if ( IsBatch )
     {
-        printf( " [%s]", GRegMemTable[ Instr.MemRegDst ] );
+        // Every program has to stop within -timeout, which only the budgeted interpreter enforces
+        if ( Engine != EngineKind::Interpreter )
+        {
+            printf( "ERROR: -batch is only supported by the interp engine!\n" );
+            return -1;
+        }
+
+        return RunBatch( FileName, ThreadCount, Timeout );
     }
-    else if ( Instr.DisplDst != UINT16_MAX )
+
+    if ( EnableProfile && Engine != EngineKind::Interpreter )
     {
-        printf( " [%d]", Instr.DisplDst );
+        printf( "ERROR: -profile is only supported by the interp engine!\n" );
+        return -1;
     }
 
-    // Print source
-    if ( Instr.RegSrc != UINT8_MAX )
+    if ( DeltaPath && Engine != EngineKind::Interpreter )
     {
-        printf( ", %s", GetRegisterName( Instr.RegSrc, Instr.Wide ) );
+        printf( "ERROR: -deltas is only supported by the interp engine!\n" );
+        return -1;
     }
-    else if ( Instr.Immediate != UINT16_MAX )
+
+    if ( TracePath && Engine != EngineKind::Interpreter )
     {
-        printf( ", %d", Instr.Immediate );
+        printf( "ERROR: -trace-out is only supported by the interp engine!\n" );
+        return -1;
     }
-    else if ( Instr.MemRegSrc != UINT8_MAX && Instr.DisplSrc != UINT8_MAX )
+
+    if ( Frames && Engine != EngineKind::Interpreter )
     {
-        printf( ", [%s + %d]", GRegMemTable[ Instr.MemRegSrc ], Instr.DisplSrc );
+        printf( "ERROR: -framebuffer is only supported by the interp engine!\n" );
+        return -1;
     }
-    else if ( Instr.MemRegSrc != UINT8_MAX )
+
+    // Both take the dirty page bits over when they look at them
+    if ( Frames && DeltaPath )
     {
-        printf( ", [%s]", GRegMemTable[ Instr.MemRegSrc ] );
+        printf( "ERROR: -framebuffer cannot be combined with -deltas!\n" );
+        return -1;
     }
-    else if ( Instr.DisplSrc != UINT16_MAX )
+
+    Storage Strg{};
+    if ( !LoadProgram( FileName, Strg ) )
     {
-        printf( ", [%d]", Instr.DisplSrc );
+        return -1;
     }
 
-    printf( "\n" );
-}
-
-void SetFlags( uint16 Result, RegisterFile& RegFile )
-{
-    RegFile.ZF = Result == 0;
-    RegFile.SF = Result & 0b1000'0000'0000'0000;
-
-    printf( "ZF: %d\n", RegFile.ZF );
-    printf( "SF: %d\n", RegFile.SF );
-}
+    ProfileData* Profile = EnableProfile ? new ProfileData{} : nullptr;
 
-void ExecuteInstruction( const Instruction& Instr, Storage& Strg )
-{
-    switch ( Instr.Name )
+    DeltaStream* Deltas = nullptr;
+    if ( DeltaPath )
     {
-    case IName::MOV:
+        FILE* DeltaFile = fopen( DeltaPath, "wb" );
+        if ( !DeltaFile )
         {
-            if ( Instr.RegDst != UINT8_MAX && Instr.RegSrc != UINT8_MAX )
-            {
-                uint16 Prev = Strg.RegFile.GPRs[ Instr.RegDst ];
-                Strg.RegFile.GPRs[ Instr.RegDst ] = Strg.RegFile.GPRs[ Instr.RegSrc ];
-                printf( "%s: 0x%04x => 0x%04x\n", GRegTableX[ Instr.RegDst ], Prev, Strg.RegFile.GPRs[ Instr.RegDst ] );
-            }
-            else if ( Instr.RegDst != UINT8_MAX && Instr.Immediate != UINT16_MAX )
-            {
-                uint16 Prev = Strg.RegFile.GPRs[ Instr.RegDst ];
-                Strg.RegFile.GPRs[ Instr.RegDst ] = Instr.Immediate;
-                printf( "%s: 0x%04x => 0x%04x\n", GRegTableX[ Instr.RegDst ], Prev, Strg.RegFile.GPRs[ Instr.RegDst ] );
-            }
-            else if ( ( Instr.MemRegDst != UINT8_MAX || Instr.DisplDst != UINT16_MAX ) && ( Instr.RegSrc != UINT8_MAX || Instr.Immediate != UINT16_MAX ) )
-            {
-                uint16 Address = CalculateMemoryAddress( Instr, Strg.RegFile );
-                if ( Address == UINT16_MAX )
-                {
-                    printf( "ERROR: Invalid memory address!\n" );
-                    break;
-                }
-
-                uint16 Value = Instr.RegSrc != UINT8_MAX ? Strg.RegFile.GPRs[ Instr.RegSrc ] : Instr.Immediate;
-                Strg.Memory[ Address ] = (uint8)( Value & 0x00ff );
-                printf( "Memory[%d] = %d\n", Address, Strg.Memory[ Address ] );
-
-                if ( Instr.Wide )
-                {
-                    Strg.Memory[ Address + 1 ] = (uint8)( Value >> 8 );
-                    printf( "Memory[%d] = %d\n", Address + 1, Strg.Memory[ Address + 1 ] );
-                }
-            }
-            else if ( Instr.RegDst != UINT8_MAX && ( Instr.MemRegSrc != UINT8_MAX || Instr.DisplSrc != UINT16_MAX ) )
-            {
-                uint16 Address = CalculateMemoryAddress( Instr, Strg.RegFile );
-                if ( Address == UINT16_MAX )
-                {
-                    printf( "ERROR: Invalid memory address!\n" );
-                    break;
-                }
-
-                uint16 ValueL = Strg.Memory[ Address ];
-                uint16 ValueH = Strg.Memory[ Address + 1 ];
-
-                Strg.RegFile.GPRs[ Instr.RegDst ] = ( ValueH << 8 ) | ( ValueL & 0x00ff );
-
-                printf( "%s = %d\n", GetRegisterName( Instr.RegDst, Instr.Wide ), Strg.RegFile.GPRs[ Instr.RegDst ] );
-            }
-
-            break;
+            printf( "ERROR: cannot write %s!\n", DeltaPath );
+            return -1;
         }
 
-    case IName::ADD:
-        {
-            if ( Instr.RegDst != UINT8_MAX && Instr.RegSrc != UINT8_MAX )
-            {
-                uint16 Prev = Strg.RegFile.GPRs[ Instr.RegDst ];
-                Strg.RegFile.GPRs[ Instr.RegDst ] += Strg.RegFile.GPRs[ Instr.RegSrc ];
-                printf( "%s: 0x%04x => 0x%04x\n", GRegTableX[ Instr.RegDst ], Prev, Strg.RegFile.GPRs[ Instr.RegDst ] );
-            }
-            else if ( Instr.RegDst != UINT8_MAX && Instr.Immediate != UINT16_MAX )
-            {
-                uint16 Prev = Strg.RegFile.GPRs[ Instr.RegDst ];
-                Strg.RegFile.GPRs[ Instr.RegDst ] += Instr.Immediate;
-                printf( "%s: 0x%04x => 0x%04x\n", GRegTableX[ Instr.RegDst ], Prev, Strg.RegFile.GPRs[ Instr.RegDst ] );
-            }
-
-            if ( Instr.RegDst != UINT8_MAX )
-            {
-                SetFlags( Strg.RegFile.GPRs[ Instr.RegDst ], Strg.RegFile );
-            }
+        Deltas = new DeltaStream{};
+        Deltas->Output = DeltaFile;
+        Deltas->Interval = DeltaInterval;
+        BeginDeltas( *Deltas, Strg );
+    }
 
-            break;
+    TraceRing* Ring = nullptr;
+    std::thread TraceWriter;
+    if ( TracePath )
+    {
+        FILE* TraceFile = fopen( TracePath, "wb" );
+        if ( !TraceFile )
+        {
+            printf( "ERROR: cannot write %s!\n", TracePath );
+            return -1;
         }
 
-    case IName::SUB:
+        uint32 RecordSize = sizeof( TraceRecord );
+        if ( 1 != fwrite( TraceFileMagic, sizeof( TraceFileMagic ), 1, TraceFile ) || 1 != fwrite( &RecordSize, sizeof( RecordSize ), 1, TraceFile ) )
         {
-            if ( Instr.RegDst != UINT8_MAX && Instr.RegSrc != UINT8_MAX )
-            {
-                uint16 Prev = Strg.RegFile.GPRs[ Instr.RegDst ];
-                Strg.RegFile.GPRs[ Instr.RegDst ] -= Strg.RegFile.GPRs[ Instr.RegSrc ];
-                printf( "%s: 0x%04x => 0x%04x\n", GRegTableX[ Instr.RegDst ], Prev, Strg.RegFile.GPRs[ Instr.RegDst ] );
-            }
-            else if ( Instr.RegDst != UINT8_MAX && Instr.Immediate != UINT16_MAX )
-            {
-                uint16 Prev = Strg.RegFile.GPRs[ Instr.RegDst ];
-                Strg.RegFile.GPRs[ Instr.RegDst ] -= Instr.Immediate;
-                printf( "%s: 0x%04x => 0x%04x\n", GRegTableX[ Instr.RegDst ], Prev, Strg.RegFile.GPRs[ Instr.RegDst ] );
-            }
+            printf( "ERROR: cannot write %s!\n", TracePath );
+            fclose( TraceFile );
+            return -1;
+        }
 
-            if ( Instr.RegDst != UINT8_MAX )
-            {
-                SetFlags( Strg.RegFile.GPRs[ Instr.RegDst ], Strg.RegFile );
-            }
+        Ring = new TraceRing{};
+        Ring->Output = TraceFile;
+        TraceWriter = std::thread( DrainTraceRing, std::ref( *Ring ) );
+    }
 
-            break;
+    if ( Frames )
+    {
+        if ( !BeginFrames( *Frames, Strg ) )
+        {
+            return -1;
         }
 
-    case IName::CMP:
+        // Clocks are only counted with a trace level above off
+        if ( Frames->IntervalInClocks )
         {
-            if ( Instr.RegDst != UINT8_MAX && Instr.RegSrc != UINT8_MAX )
-            {
-                uint16 Res = Strg.RegFile.GPRs[ Instr.RegDst ] - Strg.RegFile.GPRs[ Instr.RegSrc ];
-                SetFlags( Res, Strg.RegFile );
-            }
-            else if ( Instr.RegDst != UINT8_MAX && Instr.Immediate != UINT16_MAX )
-            {
-                uint16 Res = Strg.RegFile.GPRs[ Instr.RegDst ] - Instr.Immediate;
-                SetFlags( Res, Strg.RegFile );
-            }
-
-            break;
+            Level = std::max( Level, TraceLevel::Summary );
         }
+    }
 
-    default:
-        break;
+    // Checks are placed by instruction count, which is only kept with a trace level above off
+    ReferenceChecker* Reference = nullptr;
+    if ( ValidateInterval )
+    {
+        Reference = new ReferenceChecker{};
+        BeginReferenceCheck( *Reference, Strg, ValidateInterval );
+        Level = std::max( Level, TraceLevel::Summary );
     }
 
-    Strg.RegFile.IP += Instr.ByteSize;
+    auto StartTime = std::chrono::steady_clock::now();
 
-    ExecuteJump( Instr, Strg.RegFile );
-}
+    uint64 InstructionCount = 0;
+    switch ( Level )
+    {
+    case TraceLevel::Off:
+        InstructionCount = RunEngine<TraceLevel::Off>( Engine, Strg, { Profile, Deltas, Ring, Frames, Reference, nullptr } );
+        break;
 
-void Simulate8086( Storage& Strg )
-{
-    const uint16 ProgramSize = *(uint16*)&Strg.Memory[0];
+    case TraceLevel::Summary:
+        InstructionCount = RunEngine<TraceLevel::Summary>( Engine, Strg, { Profile, Deltas, Ring, Frames, Reference, nullptr } );
+        break;
 
-    for (;;)
-    {
-        Instruction Instr = DecodeInstruction( Strg.Memory + 2 + Strg.RegFile.IP );
-        PrintInstruction( Instr );
-        ExecuteInstruction( Instr, Strg );
+    case TraceLevel::Full:
+        InstructionCount = RunEngine<TraceLevel::Full>( Engine, Strg, { Profile, Deltas, Ring, Frames, Reference, nullptr } );
+        break;
+    }
 
-        printf( "----------------\n" );
+    double Seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - StartTime ).count();
 
-        if ( Strg.RegFile.IP >= ProgramSize )
+    // A trace or stream that could not be written fails the run once everything else is reported
+    bool OutputFailed = false;
+    if ( Ring )
+    {
+        Ring->Done.store( true, std::memory_order_release );
+        TraceWriter.join();
+        if ( 0 != fclose( Ring->Output ) || Ring->Failed )
         {
-            break;
+            printf( "ERROR: cannot write %s!\n", TracePath );
+            OutputFailed = true;
         }
+
+        delete Ring;
     }
-}
 
-int main( int argc, char** argv )
-{
-    if ( argc < 2 )
+    if ( Level != TraceLevel::Off )
     {
-        return -1;
+        printf( "Executed instructions: %llu in %.3f ms (%.2f MIPS)\n",
+                (unsigned long long)InstructionCount, Seconds * 1000.0, Seconds > 0.0 ? InstructionCount / Seconds / 1e6 : 0.0 );
+        PrintClockStats( Strg.Clocks );
     }
 
-    const char* FileName = argv[1];
-
-    FILE* InputFile = fopen( FileName, "rb" );
-    fseek( InputFile, 0L, SEEK_END );
-    long FileSize = ftell( InputFile );
-    fseek( InputFile, 0L, SEEK_SET );
-
-    if ( FileSize >= UINT16_MAX )
+    if ( Profile )
     {
-        printf( "ERROR: the program is too long!" );
-        return fclose( InputFile );
+        PrintProfile( *Profile, Strg.Memory );
+        delete Profile;
     }
 
-    const uint16 ProgramSize = (uint16)FileSize;
+    if ( Deltas )
+    {
+        printf( "Memory deltas: %llu records in %llu flushes\n", (unsigned long long)Deltas->Records, (unsigned long long)Deltas->Flushes );
+        if ( 0 != fclose( Deltas->Output ) || Deltas->Failed )
+        {
+            printf( "ERROR: cannot write %s!\n", DeltaPath );
+            OutputFailed = true;
+        }
 
-    Storage Strg{};
+        delete Deltas;
+    }
 
-    // Copy the program size into the first 2 bytes of memory
-    memcpy( &Strg.Memory[0], &ProgramSize, 2 );
+    if ( Frames )
+    {
+        printf( "Frames: %llu written, %llu unchanged skipped\n", (unsigned long long)Frames->Frames, (unsigned long long)Frames->Skipped );
+        OutputFailed = OutputFailed || Frames->Failed;
+    }
 
-    // Copy the program itself into memory starting from byte 2
-    fread( &Strg.Memory[2], ProgramSize, 1, InputFile );
-    fclose( InputFile );
+    if ( Reference )
+    {
+        bool Diverged = Reference->Diverged;
+        printf( "Reference check: %llu checks every %u instructions, %s\n",
+                (unsigned long long)Reference->Checks, ValidateInterval, Diverged ? "diverged" : "matched" );
+        EndReferenceCheck( *Reference );
+        delete Reference;
 
-    Simulate8086( Strg );
+        if ( Diverged )
+        {
+            return -1;
+        }
+    }
 
     printf( "\n\nFinal registers:\n" );
 
@@ -901,12 +7101,42 @@ int main( int argc, char** argv )
         printf( "%s: 0x%04x\n", GRegTableX[i], Strg.RegFile.GPRs[i] );
     }
 
-    printf( "ZF: %d\n", Strg.RegFile.ZF );
-    printf( "SF: %d\n", Strg.RegFile.SF );
+    for ( uint32 i = 0; i < sizeof(GSegTable) / sizeof(GSegTable[0]); i++ )
+    {
+        if ( Strg.RegFile.Segs[i] )
+        {
+            printf( "%s: 0x%04x\n", GSegTable[i], Strg.RegFile.Segs[i] );
+        }
+    }
+
+    PrintFlags( EvaluateFlags( Strg.RegFile ) );
     printf( "IP: %d\n", Strg.RegFile.IP );
 
-    FILE* DumpFile = fopen( "mem_dump.bin", "wb" );
-    fwrite( Strg.Memory, sizeof( Strg.Memory ), 1, DumpFile );
+    if ( Dump == DumpFormat::None )
+    {
+        ReleaseHighPages( Strg );
+        return OutputFailed ? -1 : 0;
+    }
+
+    // Only programs that stored above 64KB get the whole address space dumped
+    bool Written = false;
+    if ( HasHighPages( Strg ) )
+    {
+        std::vector<uint8> Flat( AddressSpaceSize );
+        memcpy( Flat.data(), Strg.Memory, sizeof( Strg.Memory ) );
+        for ( uint32 Page = 0; Page < HighPageCount; Page++ )
+        {
+            memcpy( &Flat[ ( 1 << 16 ) + ( Page << HighPageShift ) ], GetHighPage( Strg, Page ), HighPageSize );
+        }
+
+        Written = WriteMemoryDump( DumpPath, Flat.data(), AddressSpaceSize, Dump );
+    }
+    else
+    {
+        Written = WriteMemoryDump( DumpPath, Strg.Memory, sizeof( Strg.Memory ), Dump );
+    }
+
+    ReleaseHighPages( Strg );
 
-    return fclose( DumpFile );
+    return Written && !OutputFailed ? 0 : -1;
 }
\ No newline at end of file